@@ -16,23 +16,58 @@
  * specified use without further testing or modification.
  */
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 #include <errno.h>
 #include <getopt.h>
+#include <math.h>
+#include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <linux/videodev2.h>
+
+#include <jpeglib.h>
 #include <vaal.h>
 #include <videostream.h>
+#include <zlib.h>
 #include <zmq.h>
 
+#include "detect_ring.h"
 #include "json.hpp"
 #include "zmq.hpp"
 
@@ -51,18 +86,51 @@ struct box {
     float ymax;
 };
 
+/**
+ * The track and the classifier fields are only added to the payload when their
+ * stage is enabled.
+ */
 struct object {
     std::string label;
     float       score;
     box         bbox;
+    int         track;
+    std::string class_label;
+    float       class_score;
+};
+
+/**
+ * The compact object published with --label-ids, the labels are indices into
+ * the label table published on the label topic.
+ */
+struct object_id {
+    int   label;
+    float score;
+    box   bbox;
+    int   track;
+    int   class_label;
+    float class_score;
 };
 
+/**
+ * The model, the frame serial and the timings of the optional stages are not
+ * part of the serialized result, they are added to the payload only when their
+ * stage is enabled.
+ */
 struct result {
     int64_t             timestamp;
+    int64_t             serial;
     int                 fps;
+    std::string         model;
+    int64_t             gate_ns;
     int64_t             load_ns;
     int64_t             model_ns;
     int64_t             boxes_ns;
+    int64_t             decode_ns;
+    int64_t             nms_ns;
+    int64_t             ensemble_ns;
+    int64_t             fusion_ns;
+    int64_t             classify_ns;
     std::vector<object> objects;
 };
 
@@ -71,8 +139,74 @@ struct capture {
     int64_t serial;
 };
 
+/**
+ * The track and its label are only added to the payload of the events of a
+ * tracked zone, which are published for each track entering or leaving.
+ */
+struct zone_event {
+    int64_t                    timestamp;
+    std::string                zone;
+    int                        occupancy;
+    int                        entered;
+    int                        exited;
+    std::map<std::string, int> counts;
+    int                        track;
+    std::string                label;
+};
+
+struct line_event {
+    int64_t     timestamp;
+    std::string line;
+    std::string direction;
+    std::string label;
+    int         track;
+    int64_t     count;
+};
+
+struct line_totals {
+    int64_t                                               timestamp;
+    std::string                                           line;
+    std::map<std::string, std::map<std::string, int64_t>> totals;
+};
+
+struct label_table {
+    int64_t                  timestamp;
+    std::string              model;
+    std::vector<std::string> labels;
+    std::vector<std::string> class_labels;
+};
+
+struct stream {
+    int64_t     timestamp;
+    std::string source;
+    std::string fourcc;
+    int         width;
+    int         height;
+    float       fps;
+};
+
+struct snapshot {
+    int64_t     timestamp;
+    int64_t     serial;
+    std::string reason;
+    box         bbox;
+    int         width;
+    int         height;
+    int64_t     encode_ns;
+    size_t      size;
+};
+
+struct connection {
+    int64_t     timestamp;
+    std::string source;
+    std::string state;
+    int64_t     attempts;
+    int64_t     downtime_ns;
+};
+
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(box, xmin, xmax, ymin, ymax)
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(object, bbox, score, label)
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(object_id, bbox, score, label)
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(result,
                                                 timestamp,
                                                 fps,
@@ -81,12 +215,52 @@ NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(result,
                                                 boxes_ns,
                                                 objects)
 NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(capture, timestamp, serial)
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(zone_event,
+                                                timestamp,
+                                                zone,
+                                                occupancy,
+                                                entered,
+                                                exited,
+                                                counts)
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(
+    line_event, timestamp, line, direction, label, track, count)
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(line_totals,
+                                                timestamp,
+                                                line,
+                                                totals)
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(
+    snapshot, timestamp, serial, reason, bbox, width, height, encode_ns, size)
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(
+    connection, timestamp, source, state, attempts, downtime_ns)
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(
+    label_table, timestamp, model, labels, class_labels)
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE_WITH_DEFAULT(
+    stream, timestamp, source, fourcc, width, height, fps)
 
 } // namespace data
 
-static int        running = 1;
-static int        verbose = 0;
-static VSLClient* vsl     = NULL;
+static int        verbose           = 0;
+static int        benchmark_nms     = 0;
+static int        benchmark_startup = 0;
+static VSLClient* vsl               = NULL;
+
+/**
+ * Cleared by quit() to stop the application and read by every thread, the
+ * atomic store is all quit() does so it can run as a signal handler.
+ */
+static std::atomic<int> running{1};
+
+/**
+ * The videostream library is only called from the capture thread, which also
+ * replaces the vsl client when reconnecting.  Frames the pipeline is done with,
+ * on the reactor or an encoder thread, are queued on vsl_returned under
+ * vsl_lock, signalling vsl_released, for the capture thread to release.
+ * vsl_held counts the frames of the client not released yet.
+ */
+static std::mutex              vsl_lock;
+static std::condition_variable vsl_released;
+static std::vector<VSLFrame*>  vsl_returned;
+static std::atomic<int>        vsl_held{0};
 
 static int
 update_fps()
@@ -109,8 +283,51 @@ update_fps()
 }
 
 /**
- * On sigint we set running to 0 (stop the event loop) and disconnect the vsl
- * client socket causing outstanding vsl_frame_wait() to terminate.
+ * The publisher carries the results along with events, such as the zone
+ * events and line crossings, which must not be replaced by the next result so
+ * messages are queued for slow subscribers, up to pub_hwm per subscriber,
+ * instead of conflated.
+ */
+static const int pub_hwm = 16;
+
+/**
+ * With --last-value URL the last message published on every topic is kept so
+ * subscribers which join can fetch it from URL, the cache holds one message
+ * for each configured topic.  Messages are only published from the reactor
+ * thread, which also serves the last values.
+ */
+static int                                last_value = 0;
+static std::map<std::string, std::string> last_values;
+
+/**
+ * Publishes the message data on topic, the topic prefixes the data as the
+ * subscribers filter on the start of the message.
+ */
+static void
+publish(zmq::socket_t& pub, const std::string& topic, const std::string& data)
+{
+    auto message = topic + data;
+    if (verbose) { std::cout << message << std::endl; }
+    pub.send(zmq::buffer(message));
+    if (last_value) { last_values[topic] = std::move(message); }
+}
+
+/**
+ * Binds the publisher with the options shared by the live results and the
+ * replay.
+ */
+static void
+publish_bind(zmq::socket_t& pub, const char* url)
+{
+    pub.set(zmq::sockopt::sndhwm, pub_hwm);
+    pub.bind(url);
+}
+
+/**
+ * On sigint we set running to 0 which stops the event loop, the capture thread
+ * notices within the 100ms timeout of vsl_frame_wait().  Nothing else is done
+ * here as quit() is also installed with signal() by the image and replay
+ * modes, where it must be async-signal-safe.
  */
 static void
 quit(int signum)
@@ -118,262 +335,7331 @@ quit(int signum)
     (void) signum;
 
     running = 0;
-    vsl_client_disconnect(vsl);
 }
 
 /**
- * This function is where we read the videostream frame and do perform model
- * inferencing with VisionPack VAAL.
+ * The native namespace implements an alternative to vaal_boxes which reads the
+ * raw model output tensors, decodes the boxes and runs one of several NMS
+ * variants.  Candidates are held in a structure-of-arrays buffer so the decode
+ * and IoU loops can be vectorized with the GCC vector extensions, which map to
+ * NEON on aarch64 and SSE on x86_64.
+ *
+ * Two output layouts are supported.  The split layout has a boxes tensor of
+ * [N, 4] normalized xmin, ymin, xmax, ymax and a scores tensor of [N, C] as
+ * produced by ModelPack.  The fused layout is a single tensor of [N, 4+C] or
+ * [N, 5+C] (with objectness) holding center x, center y, width and height in
+ * model input pixels as produced by YOLO exports, the transposed [4+C, N]
+ * variant is also accepted.
  */
-static int
-handle_vsl(zmq::socket_t&        pub,
-           const std::string&    topic,
-           const std::string&    capture,
-           VAALContext*          vaal,
-           std::vector<VAALBox>& boxes)
+namespace native
 {
-    int     err;
-    int64_t start;
+enum class nms { standard, classes, soft, diou, matrix };
 
-    /**
-     * The vsl_frame_wait function will block until the next frame is received.
-     *
-     * IMPORTANT: vsl_frame_release must be called on the VSLFrame returned by
-     * this function.  Failure to do so will result in leaked file descriptors
-     * and the eventual termination of the application by the operating system.
-     */
-    VSLFrame* frame = vsl_frame_wait(vsl, 0);
-    if (!frame) { return 0; }
+typedef float v4f __attribute__((vector_size(16)));
 
-    /**
-     * The vsl_frame_trylock will attempt to lock the frame so that it can live
-     * longer than the default lifespan, typically 100ms. It is technically not
-     * needed in this case as the vaal_load_frame function will complete well
-     * within the default lifespan of the frame as load_frame will complete in
-     * under 5ms.  The trylock is included of illustrative purposes for cases
-     * where the frame could be used beyond the default 100ms lifespan.
-     */
-    err = vsl_frame_trylock(frame);
-    if (err) {
-        fprintf(stderr, "failed to lock frame: %s\n", strerror(errno));
-        vsl_frame_release(frame);
-        return 0;
+static const float  soft_sigma   = 0.5f;
+static const float  matrix_sigma = 2.0f;
+static const size_t matrix_max   = 1000;
+
+static int
+parse_nms(const char* name, nms& type)
+{
+    if (!strcmp(name, "standard")) {
+        type = nms::standard;
+    } else if (!strcmp(name, "class")) {
+        type = nms::classes;
+    } else if (!strcmp(name, "soft")) {
+        type = nms::soft;
+    } else if (!strcmp(name, "diou")) {
+        type = nms::diou;
+    } else if (!strcmp(name, "matrix")) {
+        type = nms::matrix;
+    } else {
+        return -1;
     }
+    return 0;
+}
 
-    auto fps       = update_fps();
-    auto timestamp = vsl_frame_timestamp(frame);
+/**
+ * Structure-of-arrays candidate buffer.  The arrays are padded to a multiple
+ * of four so the vector loops never need a scalar tail.
+ */
+struct candidates {
+    std::vector<float> xmin, ymin, xmax, ymax, area, score;
+    std::vector<int>   label;
+    size_t             count = 0;
 
-    /**
-     * If capture is set then we need to publish a capture event with timestamp
-     * and frame serial so that other services, such as image logging, can be
-     * synchronized with the model frame capture.
-     */
-    if (capture.size()) {
-        json payload = data::capture{
-            .timestamp = timestamp,
-            .serial    = vsl_frame_serial(frame),
-        };
-        auto message = capture + payload.dump(4);
-        if (verbose) { std::cout << message << std::endl; }
-        pub.send(zmq::buffer(message));
+    void
+    resize(size_t n)
+    {
+        size_t padded = (n + 3) & ~size_t(3);
+        for (auto* v : {&xmin, &ymin, &xmax, &ymax, &area, &score}) {
+            v->assign(padded, 0.0f);
+        }
+        label.assign(padded, -1);
+        count = n;
     }
 
-    start = vaal_clock_now();
-    err   = vaal_load_frame_dmabuf(vaal,
-                                 NULL,
-                                 vsl_frame_handle(frame),
-                                 vsl_frame_fourcc(frame),
-                                 vsl_frame_width(frame),
-                                 vsl_frame_height(frame),
-                                 NULL,
-                                 0);
-    vsl_frame_unlock(frame);
-    vsl_frame_release(frame);
-
-    if (err) {
-        fprintf(stderr,
-                "failed to load frame into model: %s\n",
-                vaal_strerror(VAALError(err)));
-        return -1;
+    void
+    swap(size_t i, size_t j)
+    {
+        std::swap(xmin[i], xmin[j]);
+        std::swap(ymin[i], ymin[j]);
+        std::swap(xmax[i], xmax[j]);
+        std::swap(ymax[i], ymax[j]);
+        std::swap(area[i], area[j]);
+        std::swap(score[i], score[j]);
+        std::swap(label[i], label[j]);
     }
+};
 
-    int64_t load_ns = vaal_clock_now() - start;
+struct candidate {
+    uint32_t anchor;
+    int      label;
+    float    score;
+};
 
-    start = vaal_clock_now();
-    err   = vaal_run_model(vaal);
-    if (err) {
-        fprintf(stderr,
-                "failed to run model: %s\n",
-                vaal_strerror(VAALError(err)));
-        return -1;
-    }
-    int64_t model_ns = vaal_clock_now() - start;
+struct decoder {
+    bool   enabled         = false;
+    nms    type            = nms::standard;
+    float  score_threshold = 0.5f;
+    float  iou_threshold   = 0.5f;
+    size_t top_k           = 256;
 
-    /**
-     * The vaal_boxes function will load our array of VAALBox structures with
-     * the bounding boxes identified by the model output.  The max_boxes
-     * parameter is the size of the boxes array while the n_boxes is updated by
-     * vaal_boxes with the actual number of bounding boxes loaded into the boxes
-     * array, in other words the number of box detections from this inference.
-     *
-     * The vaal_boxes function internally handles the model output box decoding
-     * and nms.
-     */
-    start = vaal_clock_now();
-    size_t n_boxes;
-    err = vaal_boxes(vaal, boxes.data(), boxes.size(), &n_boxes);
-    if (err) {
-        fprintf(stderr,
-                "failed to read bounding boxes from model: %s\n",
-                vaal_strerror(VAALError(err)));
+    NNTensor* boxes      = NULL;
+    NNTensor* scores     = NULL;
+    size_t    anchors    = 0;
+    size_t    classes    = 0;
+    size_t    offset     = 0;
+    bool      fused      = false;
+    bool      transposed = false;
+    bool      objectness = false;
+    float     width      = 1.0f;
+    float     height     = 1.0f;
+
+    std::vector<candidate> selected;
+    std::vector<float>     iou;
+    std::vector<uint8_t>   removed;
+    candidates             cand;
+
+    int64_t decode_ns = 0;
+    int64_t nms_ns    = 0;
+};
+
+/**
+ * Quantized view of a tensor, float tensors use a scale of one and a zero
+ * point of zero so the same code path handles every supported type.
+ */
+struct tensor_view {
+    NNTensorType type;
+    const void*  data;
+    float        scale;
+    int32_t      zero;
+};
+
+static int
+tensor_map(NNTensor* tensor, tensor_view& view)
+{
+    view.type  = nn_tensor_type(tensor);
+    view.scale = 1.0f;
+    view.zero  = 0;
+
+    switch (view.type) {
+    case NNTensorType_F32:
+        break;
+    case NNTensorType_I8:
+    case NNTensorType_U8: {
+        size_t         n_scales = 0, n_zeros = 0;
+        const float*   scales   = nn_tensor_scales(tensor, &n_scales);
+        const int32_t* zeros    = nn_tensor_zeros(tensor, &n_zeros);
+        if (n_scales) { view.scale = scales[0]; }
+        if (n_zeros) { view.zero = zeros[0]; }
+        break;
+    }
+    default:
         return -1;
     }
-    int64_t boxes_ns = vaal_clock_now() - start;
 
-    /**
-     * The following code generates a JSON structure with the inference results.
-     * The model and timing information is populated into fields of the root
-     * object then an array of detected boxes is populated.
-     */
-    data::result result = {
-        .timestamp = timestamp,
-        .fps       = fps,
-        .load_ns   = load_ns,
-        .model_ns  = model_ns,
-        .boxes_ns  = boxes_ns,
-    };
+    view.data = nn_tensor_mapro(tensor);
+    return view.data ? 0 : -1;
+}
 
-    for (size_t i = 0; i < n_boxes; i++) {
-        const VAALBox* box   = &boxes[i];
-        const char*    label = vaal_label(vaal, box->label);
+template <typename T>
+static inline float
+dequantize(const tensor_view& view, size_t index)
+{
+    const T* data = static_cast<const T*>(view.data);
+    return (float(data[index]) - view.zero) * view.scale;
+}
 
-        result.objects.push_back({
-            .label = label ? label : "",
-            .score = box->score,
-            .bbox =
-                {
-                    .xmin = box->xmin,
-                    .xmax = box->xmax,
-                    .ymin = box->ymin,
-                    .ymax = box->ymax,
-                },
-        });
+static inline float
+load(const tensor_view& view, size_t index)
+{
+    switch (view.type) {
+    case NNTensorType_I8:
+        return dequantize<int8_t>(view, index);
+    case NNTensorType_U8:
+        return dequantize<uint8_t>(view, index);
+    default:
+        return static_cast<const float*>(view.data)[index];
     }
+}
 
-    json payload = result;
-    auto message = topic + payload.dump(4);
-    if (verbose) { std::cout << message << std::endl; }
-    pub.send(zmq::buffer(message));
+/**
+ * Converts the score threshold into the quantized domain of the tensor so the
+ * score scan can reject anchors without dequantizing every element.
+ */
+template <typename T>
+static inline T
+quantize_threshold(const tensor_view& view, float threshold)
+{
+    if (std::is_floating_point<T>::value) { return T(threshold); }
+    float q  = ceilf(threshold / view.scale + view.zero);
+    float lo = float(std::numeric_limits<T>::min());
+    float hi = float(std::numeric_limits<T>::max());
+    return T(std::min(std::max(q, lo), hi));
+}
 
-    return 0;
+template <typename T>
+static inline T
+row_max(const T* row, size_t n)
+{
+    T m = row[0];
+    for (size_t i = 1; i < n; i++) { m = row[i] > m ? row[i] : m; }
+    return m;
 }
 
-int
-main(int argc, char** argv)
+template <>
+inline float
+row_max<float>(const float* row, size_t n)
 {
-    int         err;
-    int         max_boxes = 50;
-    float       threshold = 0.5f;
-    float       iou       = 0.5f;
-    const char* engine    = "npu";
-    const char* vslpath   = "/tmp/camera.vsl";
-    const char* puburl    = "ipc:///tmp/detect.pub";
-    std::string topic     = "DETECTION";
-    std::string capture   = "";
+    size_t i = 0;
+    float  m = row[0];
 
-    struct option options[] = {
-        {"help", no_argument, NULL, 'h'},
-        {"version", no_argument, NULL, 'V'},
-        {"verbose", no_argument, NULL, 'v'},
-        {"engine", required_argument, NULL, 'e'},
-        {"vsl", required_argument, NULL, 's'},
-        {"pub", required_argument, NULL, 'p'},
-        {"topic", required_argument, NULL, 't'},
-        {"capture-topic", required_argument, NULL, 'c'},
-        {"max-boxes", required_argument, NULL, 'm'},
-        {"threshold", required_argument, NULL, 'T'},
-        {"iou", required_argument, NULL, 'I'},
-        {NULL},
-    };
+    if (n >= 4) {
+        v4f acc;
+        memcpy(&acc, row, sizeof(acc));
+        for (i = 4; i + 4 <= n; i += 4) {
+            v4f v;
+            memcpy(&v, row + i, sizeof(v));
+            acc = v > acc ? v : acc;
+        }
+        m = std::max(std::max(acc[0], acc[1]), std::max(acc[2], acc[3]));
+    }
 
-    for (;;) {
-        int opt = getopt_long(argc, argv, "hVve:m:s:p:t:c:T:I:", options, NULL);
-        if (opt == -1) break;
+    for (; i < n; i++) { m = row[i] > m ? row[i] : m; }
+    return m;
+}
 
-        switch (opt) {
-        case 'h':
-            printf("detect [OPTIONS] MODEL\n"
-                   "-h, --help\n"
-                   "    display help information\n"
-                   "-V, --version\n"
-                   "    display version information\n"
-                   "-v, --verbose\n"
-                   "   enable verbose logging of each message\n"
-                   "-m MAX --max-boxes MAX\n"
-                   "    maximum detection boxes per frame (default: %d)\n"
-                   "-T THRESHOLD, --threshold THRESHOLD\n"
-                   "    set the detection threshold (default: %.2f)\n"
-                   "-I IOU, --iou IOU\n"
-                   "    set the detection iou for nms (default: %.02f)\n"
-                   "-e ENGINE, --engine ENGINE\n"
-                   "    select the inference engine device [cpu, gpu, npu*]\n"
-                   "-s PATH, --vsl PATH\n"
-                   "    vsl socket path to capture frames (default: %s)\n"
-                   "-p URL, --pub URL\n"
-                   "    url for the result message queue (default: %s)\n"
-                   "-t TOPIC, --topic TOPIC\n"
-                   "    subscribe to publisher topic (default: '%s')\n"
-                   "-c TOPIC, --capture TOPIC\n"
-                   "    publish capture event to TOPIC when frame is loaded\n",
-                   max_boxes,
-                   threshold,
-                   iou,
-                   vslpath,
-                   puburl,
-                   topic.c_str());
-            return EXIT_SUCCESS;
-        case 'V':
-            printf("detect %s\n", VERSION);
-            return EXIT_SUCCESS;
-        case 'v':
-            verbose = 1;
-            break;
-        case 'e':
-            engine = optarg;
-            break;
-        case 'm':
-            max_boxes = atoi(optarg);
-            break;
-        case 'T':
-            threshold = atof(optarg);
-            break;
-        case 't':
-            topic = optarg;
-            break;
-        case 'c':
-            capture = optarg;
-            break;
-        case 's':
-            vslpath = optarg;
-            break;
-        case 'p':
-            puburl = optarg;
-            break;
-        default:
-            fprintf(stderr,
-                    "invalid parameter %c, try --help for usage\n",
-                    opt);
-            return EXIT_FAILURE;
+/**
+ * Scans anchor-major scores ([N, C] rows) for the best class of each anchor,
+ * only anchors which pass the quantized threshold are dequantized.
+ */
+template <typename T>
+static void
+scan_rows(decoder& dec, const tensor_view& view, size_t stride)
+{
+    const T* base = static_cast<const T*>(view.data);
+    const T  qthr = quantize_threshold<T>(view, dec.score_threshold);
+
+    for (size_t a = 0; a < dec.anchors; a++) {
+        const T* row = base + a * stride;
+        if (dec.objectness && row[4] < qthr) { continue; }
+
+        const T* cls = row + dec.offset;
+        T        m   = row_max(cls, dec.classes);
+        if (m < qthr) { continue; }
+
+        float score = (float(m) - view.zero) * view.scale;
+        if (dec.objectness) {
+            score *= (float(row[4]) - view.zero) * view.scale;
         }
-    }
+        if (score < dec.score_threshold) { continue; }
 
-    if (argv[optind] == NULL) {
-        fprintf(stderr, "missing required model, try --help for usage\n");
-        return EXIT_FAILURE;
+        int label = int(std::find(cls, cls + dec.classes, m) - cls);
+        dec.selected.push_back({uint32_t(a), label, score});
     }
+}
+
+/**
+ * Scans class-major scores ([C, N] planes) keeping a running best per anchor,
+ * the inner loop runs over contiguous anchors and is vectorized by the
+ * compiler.
+ */
+template <typename T>
+static void
+scan_planes(decoder& dec, const tensor_view& view)
+{
+    const T* base = static_cast<const T*>(view.data);
+    const T  qthr = quantize_threshold<T>(view, dec.score_threshold);
+    size_t   n    = dec.anchors;
+
+    const T*             first = base + dec.offset * n;
+    std::vector<T>       best(first, first + n);
+    std::vector<int32_t> label(n, 0);
+
+    for (size_t c = 1; c < dec.classes; c++) {
+        const T* __restrict plane = base + (dec.offset + c) * n;
+        T* __restrict b           = best.data();
+        int32_t* __restrict l     = label.data();
+        for (size_t a = 0; a < n; a++) {
+            bool gt = plane[a] > b[a];
+            b[a]    = gt ? plane[a] : b[a];
+            l[a]    = gt ? int32_t(c) : l[a];
+        }
+    }
+
+    for (size_t a = 0; a < n; a++) {
+        if (best[a] < qthr) { continue; }
+        float score = (float(best[a]) - view.zero) * view.scale;
+        if (dec.objectness) {
+            score *= (float(base[4 * n + a]) - view.zero) * view.scale;
+        }
+        if (score < dec.score_threshold) { continue; }
+        dec.selected.push_back({uint32_t(a), label[a], score});
+    }
+}
+
+/**
+ * Inspects the model outputs and configures the decoder for the split or fused
+ * layout.  Returns -1 if the model outputs are not supported.
+ */
+static int
+decoder_init(decoder& dec, VAALContext* vaal)
+{
+    int n_outputs = vaal_output_count(vaal);
+
+    /*
+     * The decoder may hold the layout of a previous model, every layout field
+     * is cleared so the result depends only on this model's outputs.
+     */
+    dec.boxes      = NULL;
+    dec.scores     = NULL;
+    dec.anchors    = 0;
+    dec.classes    = 0;
+    dec.offset     = 0;
+    dec.fused      = false;
+    dec.transposed = false;
+    dec.objectness = false;
+    dec.width      = 1.0f;
+    dec.height     = 1.0f;
+
+    NNTensor* input = vaal_input_tensor(vaal, 0);
+    if (input && nn_tensor_dims(input) == 4) {
+        const int32_t* shape = nn_tensor_shape(input);
+        dec.height           = float(shape[1]);
+        dec.width            = float(shape[2]);
+    }
+
+    if (n_outputs == 2) {
+        NNTensor* a = vaal_output_tensor(vaal, 0);
+        NNTensor* b = vaal_output_tensor(vaal, 1);
+        if (nn_tensor_dims(a) < 1 || nn_tensor_dims(b) < 1) { return -1; }
+        if (nn_tensor_shape(b)[nn_tensor_dims(b) - 1] == 4) { std::swap(a, b); }
+        if (nn_tensor_shape(a)[nn_tensor_dims(a) - 1] != 4) { return -1; }
+
+        dec.boxes   = a;
+        dec.scores  = b;
+        dec.anchors = nn_tensor_volume(a) / 4;
+        if (!dec.anchors) { return -1; }
+        dec.classes = nn_tensor_volume(b) / dec.anchors;
+        return dec.classes * dec.anchors == size_t(nn_tensor_volume(b)) ? 0
+                                                                       : -1;
+    }
+
+    if (n_outputs == 1) {
+        NNTensor*      t     = vaal_output_tensor(vaal, 0);
+        int            dims  = nn_tensor_dims(t);
+        const int32_t* shape = nn_tensor_shape(t);
+        if (dims < 2) { return -1; }
+
+        size_t rows = shape[dims - 2];
+        size_t cols = shape[dims - 1];
+
+        dec.boxes      = t;
+        dec.scores     = t;
+        dec.fused      = true;
+        dec.transposed = cols > rows;
+        dec.anchors    = dec.transposed ? cols : rows;
+        if (!dec.anchors) { return -1; }
+
+        size_t width   = dec.transposed ? rows : cols;
+        int    labels  = vaal_label_count(vaal);
+        dec.objectness = labels > 0 && width == size_t(labels) + 5;
+        dec.offset     = dec.objectness ? 5 : 4;
+        if (width <= dec.offset) { return -1; }
+        dec.classes = width - dec.offset;
+        return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * Gathers the coordinates of the selected anchors into the candidate buffer
+ * then converts them to normalized corners four candidates at a time.
+ */
+static void
+decode(decoder& dec, const tensor_view& view)
+{
+    size_t      n    = dec.selected.size();
+    candidates& cand = dec.cand;
+    cand.resize(n);
+
+    for (size_t i = 0; i < n; i++) {
+        size_t a = dec.selected[i].anchor;
+        size_t c[4];
+        for (size_t k = 0; k < 4; k++) {
+            if (!dec.fused) {
+                c[k] = a * 4 + k;
+            } else if (dec.transposed) {
+                c[k] = k * dec.anchors + a;
+            } else {
+                c[k] = a * (dec.offset + dec.classes) + k;
+            }
+        }
+        cand.xmin[i]  = load(view, c[0]);
+        cand.ymin[i]  = load(view, c[1]);
+        cand.xmax[i]  = load(view, c[2]);
+        cand.ymax[i]  = load(view, c[3]);
+        cand.score[i] = dec.selected[i].score;
+        cand.label[i] = dec.selected[i].label;
+    }
+
+    const v4f zero = {0, 0, 0, 0};
+    const v4f one  = {1, 1, 1, 1};
+    const v4f half = {0.5f, 0.5f, 0.5f, 0.5f};
+    const v4f sx   = one / dec.width;
+    const v4f sy   = one / dec.height;
+
+    for (size_t i = 0; i < cand.xmin.size(); i += 4) {
+        v4f x0, y0, x1, y1;
+        memcpy(&x0, &cand.xmin[i], sizeof(v4f));
+        memcpy(&y0, &cand.ymin[i], sizeof(v4f));
+        memcpy(&x1, &cand.xmax[i], sizeof(v4f));
+        memcpy(&y1, &cand.ymax[i], sizeof(v4f));
+
+        if (dec.fused) {
+            v4f cx = x0 * sx, cy = y0 * sy;
+            v4f hw = x1 * sx * half, hh = y1 * sy * half;
+            x0     = cx - hw;
+            y0     = cy - hh;
+            x1     = cx + hw;
+            y1     = cy + hh;
+        }
+
+        x0 = x0 < zero ? zero : (x0 > one ? one : x0);
+        y0 = y0 < zero ? zero : (y0 > one ? one : y0);
+        x1 = x1 < zero ? zero : (x1 > one ? one : x1);
+        y1 = y1 < zero ? zero : (y1 > one ? one : y1);
+
+        v4f w = x1 - x0, h = y1 - y0;
+        v4f area = (w < zero ? zero : w) * (h < zero ? zero : h);
+
+        memcpy(&cand.xmin[i], &x0, sizeof(v4f));
+        memcpy(&cand.ymin[i], &y0, sizeof(v4f));
+        memcpy(&cand.xmax[i], &x1, sizeof(v4f));
+        memcpy(&cand.ymax[i], &y1, sizeof(v4f));
+        memcpy(&cand.area[i], &area, sizeof(v4f));
+    }
+}
+
+/**
+ * Computes the IoU (or DIoU) of candidate i against candidates [begin, end)
+ * into out[begin, end).  The range is widened to whole vectors which is safe
+ * because the candidate arrays are padded.
+ */
+static void
+overlap(const candidates& c, size_t i, size_t begin, size_t end, float* out,
+        bool diou)
+{
+    const v4f zero = {0, 0, 0, 0};
+    const v4f eps  = {1e-9f, 1e-9f, 1e-9f, 1e-9f};
+    const v4f x0   = {c.xmin[i], c.xmin[i], c.xmin[i], c.xmin[i]};
+    const v4f y0   = {c.ymin[i], c.ymin[i], c.ymin[i], c.ymin[i]};
+    const v4f x1   = {c.xmax[i], c.xmax[i], c.xmax[i], c.xmax[i]};
+    const v4f y1   = {c.ymax[i], c.ymax[i], c.ymax[i], c.ymax[i]};
+    const v4f a    = {c.area[i], c.area[i], c.area[i], c.area[i]};
+
+    for (size_t j = begin & ~size_t(3); j < end; j += 4) {
+        v4f bx0, by0, bx1, by1, ba;
+        memcpy(&bx0, &c.xmin[j], sizeof(v4f));
+        memcpy(&by0, &c.ymin[j], sizeof(v4f));
+        memcpy(&bx1, &c.xmax[j], sizeof(v4f));
+        memcpy(&by1, &c.ymax[j], sizeof(v4f));
+        memcpy(&ba, &c.area[j], sizeof(v4f));
+
+        v4f ix0 = bx0 > x0 ? bx0 : x0;
+        v4f iy0 = by0 > y0 ? by0 : y0;
+        v4f ix1 = bx1 < x1 ? bx1 : x1;
+        v4f iy1 = by1 < y1 ? by1 : y1;
+        v4f iw  = ix1 - ix0;
+        v4f ih  = iy1 - iy0;
+        iw      = iw < zero ? zero : iw;
+        ih      = ih < zero ? zero : ih;
+
+        v4f inter = iw * ih;
+        v4f iou   = inter / (a + ba - inter + eps);
+
+        if (diou) {
+            v4f cx = (bx0 + bx1 - x0 - x1) * 0.5f;
+            v4f cy = (by0 + by1 - y0 - y1) * 0.5f;
+            v4f ex = (bx1 > x1 ? bx1 : x1) - (bx0 < x0 ? bx0 : x0);
+            v4f ey = (by1 > y1 ? by1 : y1) - (by0 < y0 ? by0 : y0);
+            iou -= (cx * cx + cy * cy) / (ex * ex + ey * ey + eps);
+        }
+
+        memcpy(out + j, &iou, sizeof(v4f));
+    }
+}
+
+static inline void
+emit(VAALBox& box, const candidates& c, size_t i)
+{
+    box.xmin  = c.xmin[i];
+    box.ymin  = c.ymin[i];
+    box.xmax  = c.xmax[i];
+    box.ymax  = c.ymax[i];
+    box.score = c.score[i];
+    box.label = c.label[i];
+}
+
+/**
+ * Greedy hard NMS used by the standard, class-aware and DIoU variants.  The
+ * candidates must be sorted by descending score.
+ */
+static size_t
+nms_greedy(decoder& dec, VAALBox* boxes, size_t max_boxes)
+{
+    candidates& c     = dec.cand;
+    bool        diou  = dec.type == nms::diou;
+    bool        label = dec.type == nms::classes;
+    size_t      n     = 0;
+
+    dec.removed.assign(c.count, 0);
+    dec.iou.resize(c.xmin.size());
+
+    for (size_t i = 0; i < c.count && n < max_boxes; i++) {
+        if (dec.removed[i]) { continue; }
+        emit(boxes[n++], c, i);
+
+        overlap(c, i, i + 1, c.count, dec.iou.data(), diou);
+        for (size_t j = i + 1; j < c.count; j++) {
+            if (label && c.label[j] != c.label[i]) { continue; }
+            if (dec.iou[j] > dec.iou_threshold) { dec.removed[j] = 1; }
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Gaussian Soft-NMS, rather than removing overlapping candidates their scores
+ * are decayed and they are dropped once below the score threshold.
+ */
+static size_t
+nms_soft(decoder& dec, VAALBox* boxes, size_t max_boxes)
+{
+    candidates& c     = dec.cand;
+    size_t      count = c.count;
+    size_t      n     = 0;
+
+    dec.iou.resize(c.xmin.size());
+
+    for (size_t i = 0; i < count && n < max_boxes; i++) {
+        size_t best = i;
+        for (size_t j = i + 1; j < count; j++) {
+            if (c.score[j] > c.score[best]) { best = j; }
+        }
+        c.swap(i, best);
+        emit(boxes[n++], c, i);
+
+        overlap(c, i, i + 1, count, dec.iou.data(), false);
+        for (size_t j = i + 1; j < count;) {
+            float iou = dec.iou[j];
+            c.score[j] *= expf(-(iou * iou) / soft_sigma);
+            if (c.score[j] < dec.score_threshold) {
+                count--;
+                c.swap(j, count);
+                dec.iou[j] = dec.iou[count];
+            } else {
+                j++;
+            }
+        }
+    }
+
+    return n;
+}
+
+/**
+ * Matrix NMS as described by SOLOv2, every decay is computed in parallel from
+ * the upper triangular IoU matrix of same-class candidates which avoids the
+ * sequential dependency of the greedy variants.  The matrix is quadratic in
+ * the candidates so only the best top_k, or matrix_max without a top_k, of the
+ * score sorted candidates are considered.
+ */
+static size_t
+nms_matrix(decoder& dec, VAALBox* boxes, size_t max_boxes)
+{
+    candidates& c      = dec.cand;
+    size_t      limit  = dec.top_k ? dec.top_k : matrix_max;
+    size_t      count  = std::min(c.count, limit);
+    size_t      stride = (count + 3) & ~size_t(3);
+
+    dec.iou.assign(count * stride, 0.0f);
+    std::vector<float> compensate(count, 0.0f);
+
+    for (size_t i = 0; i < count; i++) {
+        float* row = &dec.iou[i * stride];
+        overlap(c, i, i + 1, count, row, false);
+        for (size_t j = i + 1; j < count; j++) {
+            if (c.label[j] != c.label[i]) { row[j] = 0.0f; }
+            compensate[j] = std::max(compensate[j], row[j]);
+        }
+    }
+
+    for (size_t j = 1; j < count; j++) {
+        float decay = 1.0f;
+        for (size_t i = 0; i < j; i++) {
+            float iou = dec.iou[i * stride + j];
+            float cmp = compensate[i];
+            float f   = expf(-matrix_sigma * (iou * iou - cmp * cmp));
+            decay     = std::min(decay, f);
+        }
+        c.score[j] *= decay;
+    }
+
+    size_t n = 0;
+    for (size_t i = 0; i < count && n < max_boxes; i++) {
+        size_t best = i;
+        for (size_t j = i + 1; j < count; j++) {
+            if (c.score[j] > c.score[best]) { best = j; }
+        }
+        c.swap(i, best);
+        if (c.score[i] < dec.score_threshold) { break; }
+        emit(boxes[n++], c, i);
+    }
+
+    return n;
+}
+
+/**
+ * Runs the native post-processing, equivalent to vaal_boxes, and records the
+ * decode and nms timings into the decoder.
+ */
+static int
+boxes(decoder& dec, VAALBox* boxes, size_t max_boxes, size_t* n_boxes)
+{
+    tensor_view bview, sview;
+    int64_t     start = vaal_clock_now();
+
+    *n_boxes = 0;
+    dec.selected.clear();
+
+    if (tensor_map(dec.scores, sview)) { return -1; }
+
+    if (dec.transposed) {
+        switch (sview.type) {
+        case NNTensorType_I8:
+            scan_planes<int8_t>(dec, sview);
+            break;
+        case NNTensorType_U8:
+            scan_planes<uint8_t>(dec, sview);
+            break;
+        default:
+            scan_planes<float>(dec, sview);
+            break;
+        }
+    } else {
+        size_t stride = dec.fused ? dec.offset + dec.classes : dec.classes;
+        switch (sview.type) {
+        case NNTensorType_I8:
+            scan_rows<int8_t>(dec, sview, stride);
+            break;
+        case NNTensorType_U8:
+            scan_rows<uint8_t>(dec, sview, stride);
+            break;
+        default:
+            scan_rows<float>(dec, sview, stride);
+            break;
+        }
+    }
+
+    /**
+     * Top-K pre-selection keeps the quadratic NMS bounded in crowded scenes,
+     * only the K best candidates are fully sorted.
+     */
+    auto by_score = [](const candidate& a, const candidate& b) {
+        return a.score > b.score;
+    };
+    auto& sel = dec.selected;
+    if (dec.top_k && sel.size() > dec.top_k) {
+        std::nth_element(sel.begin(), sel.begin() + dec.top_k, sel.end(),
+                         by_score);
+        sel.resize(dec.top_k);
+    }
+    std::sort(sel.begin(), sel.end(), by_score);
+
+    if (dec.boxes != dec.scores) {
+        nn_tensor_unmap(dec.scores);
+        if (tensor_map(dec.boxes, bview)) { return -1; }
+    } else {
+        bview = sview;
+    }
+
+    decode(dec, bview);
+    nn_tensor_unmap(dec.boxes);
+    dec.decode_ns = vaal_clock_now() - start;
+
+    start = vaal_clock_now();
+    switch (dec.type) {
+    case nms::soft:
+        *n_boxes = nms_soft(dec, boxes, max_boxes);
+        break;
+    case nms::matrix:
+        *n_boxes = nms_matrix(dec, boxes, max_boxes);
+        break;
+    default:
+        *n_boxes = nms_greedy(dec, boxes, max_boxes);
+        break;
+    }
+    dec.nms_ns = vaal_clock_now() - start;
+
+    return 0;
+}
+
+/**
+ * Runs whichever of vaal_boxes and the native path was not selected for the
+ * frame and accumulates both timings, enabled with --benchmark-nms and reported
+ * every 100 frames.  The accumulators are shared so it only runs on the single
+ * pipeline of the live modes, --images rejects it.
+ */
+static void
+compare(VAALContext* vaal,
+        decoder&     dec,
+        size_t       max_boxes,
+        int64_t      boxes_ns,
+        size_t       n_boxes)
+{
+    static std::vector<VAALBox> scratch;
+    static int64_t frames, vaal_ns, native_ns, decode_ns, nms_ns;
+    static int64_t vaal_n, native_n;
+
+    scratch.resize(max_boxes);
+    size_t  n     = 0;
+    int64_t start = vaal_clock_now();
+    int     err   = dec.enabled
+                        ? vaal_boxes(vaal, scratch.data(), max_boxes, &n)
+                        : boxes(dec, scratch.data(), max_boxes, &n);
+    int64_t ns    = vaal_clock_now() - start;
+    if (err) { return; }
+
+    vaal_ns += dec.enabled ? ns : boxes_ns;
+    vaal_n += dec.enabled ? n : n_boxes;
+    native_ns += dec.enabled ? boxes_ns : ns;
+    native_n += dec.enabled ? n_boxes : n;
+    decode_ns += dec.decode_ns;
+    nms_ns += dec.nms_ns;
+
+    if (++frames < 100) { return; }
+
+    printf("nms benchmark (%lld frames): vaal_boxes %.1fus %.1f boxes, "
+           "native %.1fus (decode %.1fus nms %.1fus) %.1f boxes\n",
+           (long long) frames,
+           vaal_ns / 1e3 / frames,
+           double(vaal_n) / frames,
+           native_ns / 1e3 / frames,
+           decode_ns / 1e3 / frames,
+           nms_ns / 1e3 / frames,
+           double(native_n) / frames);
+    frames = vaal_ns = native_ns = decode_ns = nms_ns = vaal_n = native_n = 0;
+}
+
+} // namespace native
+
+/**
+ * Loads a JSON configuration file, errors are reported to stderr.
+ */
+static int
+load_json(const char* path, json& config)
+{
+    try {
+        std::ifstream file(path);
+        if (!file) {
+            fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+            return -1;
+        }
+        config = json::parse(file);
+    } catch (const json::exception& err) {
+        fprintf(stderr, "failed to parse %s: %s\n", path, err.what());
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Resolves a label name from a configuration file to the model class index,
+ * returns -1 with a warning if the model has no such label.
+ */
+static int
+label_index(VAALContext* vaal, const std::string& name, const char* path)
+{
+    int n_labels = vaal_label_count(vaal);
+    for (int i = 0; i < n_labels; i++) {
+        const char* label = vaal_label(vaal, i);
+        if (label && name == label) { return i; }
+    }
+    fprintf(stderr, "warning: %s: unknown label %s\n", path, name.c_str());
+    return -1;
+}
+
+/**
+ * Copies the labels of the model once so results do not look them up for each
+ * box.
+ */
+static void
+label_intern(std::vector<std::string>& labels, VAALContext* vaal)
+{
+    int count = vaal ? vaal_label_count(vaal) : 0;
+
+    labels.clear();
+    for (int i = 0; i < count; i++) {
+        const char* label = vaal_label(vaal, i);
+        labels.push_back(label ? label : "");
+    }
+}
+
+static const std::string&
+label_text(const std::vector<std::string>& labels, int index)
+{
+    static const std::string empty;
+    if (index < 0 || size_t(index) >= labels.size()) { return empty; }
+    return labels[index];
+}
+
+/**
+ * Returns the label of index as the zone and line events name it: its text,
+ * or the index itself with label_ids or when the model has no text for it.
+ */
+static std::string
+label_name(const std::vector<std::string>& labels, bool label_ids, int index)
+{
+    const std::string& text = label_text(labels, index);
+    if (label_ids || text.empty()) { return std::to_string(index); }
+    return text;
+}
+
+/**
+ * Resolves a comma separated list of label names into a table of flags indexed
+ * by class.
+ */
+static void
+label_list(VAALContext*          vaal,
+           const char*           list,
+           const char*           source,
+           std::vector<uint8_t>& classes)
+{
+    std::string names(list);
+    classes.assign(std::max(vaal_label_count(vaal), 0), 0);
+
+    for (size_t pos = 0; pos <= names.size();) {
+        size_t end = names.find(',', pos);
+        if (end == std::string::npos) { end = names.size(); }
+        int i = label_index(vaal, names.substr(pos, end - pos), source);
+        if (i >= 0) { classes[i] = 1; }
+        pos = end + 1;
+    }
+}
+
+/**
+ * Per-class score thresholds and allow/deny lists loaded from a JSON file with
+ * the --filter option, for example:
+ *
+ *     {
+ *         "default": 0.5,
+ *         "thresholds": { "person": 0.3, "car": 0.6 },
+ *         "allow": [ "person", "car", "bicycle" ],
+ *         "deny": [ "bicycle" ]
+ *     }
+ *
+ * All keys are optional, the default threshold falls back to --threshold.  When
+ * an allow list is present only those classes are reported, the deny list is
+ * applied afterwards.  Labels are resolved to class indices once at startup so
+ * the per-frame filter is a table lookup per box.
+ */
+struct class_filter {
+    float              fallback = 0.5f;
+    std::vector<float> thresholds;
+};
+
+static int
+filter_load(class_filter& filter,
+            const char*   path,
+            VAALContext*  vaal,
+            float         threshold)
+{
+    json config;
+    if (load_json(path, config)) { return -1; }
+
+    int n_labels    = std::max(vaal_label_count(vaal), 0);
+    filter.fallback = config.value("default", threshold);
+    filter.thresholds.assign(n_labels, filter.fallback);
+
+    auto index = [&](const std::string& name) {
+        return label_index(vaal, name, path);
+    };
+
+    try {
+        if (config.contains("thresholds")) {
+            for (auto& item : config["thresholds"].items()) {
+                int i = index(item.key());
+                if (i >= 0) { filter.thresholds[i] = item.value(); }
+            }
+        }
+
+        if (config.contains("allow")) {
+            std::vector<float> allowed(n_labels, INFINITY);
+            for (auto& name : config["allow"]) {
+                int i = index(name);
+                if (i >= 0) { allowed[i] = filter.thresholds[i]; }
+            }
+            filter.thresholds.swap(allowed);
+        }
+
+        if (config.contains("deny")) {
+            for (auto& name : config["deny"]) {
+                int i = index(name);
+                if (i >= 0) { filter.thresholds[i] = INFINITY; }
+            }
+        }
+    } catch (const json::exception& err) {
+        fprintf(stderr, "invalid filter %s: %s\n", path, err.what());
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * The lowest threshold in the table, the model itself must run at this
+ * threshold so the rare classes with a low threshold are not lost.
+ */
+static float
+filter_minimum(const class_filter& filter)
+{
+    float minimum = filter.fallback;
+    for (float t : filter.thresholds) { minimum = std::min(minimum, t); }
+    return minimum;
+}
+
+/**
+ * Compacts the boxes array in place keeping only the boxes which pass their
+ * class threshold and returns the new number of boxes.
+ */
+static size_t
+filter_apply(const class_filter& filter, VAALBox* boxes, size_t n_boxes)
+{
+    size_t n = 0;
+
+    for (size_t i = 0; i < n_boxes; i++) {
+        int   label     = boxes[i].label;
+        float threshold = label >= 0 && size_t(label) < filter.thresholds.size()
+                              ? filter.thresholds[label]
+                              : filter.fallback;
+        if (boxes[i].score < threshold) { continue; }
+        if (n != i) { boxes[n] = boxes[i]; }
+        n++;
+    }
+
+    return n;
+}
+
+/**
+ * Polygon zones loaded from a JSON file with the --zones option, coordinates
+ * are normalized to the frame like the detection boxes.
+ *
+ *     {
+ *         "hold": 3,
+ *         "zones": [
+ *             {
+ *                 "name": "door",
+ *                 "points": [[0.1, 0.5], [0.4, 0.5], [0.4, 1.0], [0.1, 1.0]],
+ *                 "classes": [ "person" ],
+ *                 "anchor": "bottom"
+ *             }
+ *         ]
+ *     }
+ *
+ * A box is inside a zone when its anchor point, the bottom center by default
+ * or the box center, is inside the polygon.  Each polygon is rasterized at load
+ * time into a grid of cells which are either fully outside, fully inside or
+ * crossed by an edge, only points landing in crossed cells need the full
+ * crossing number test.
+ *
+ * Zone events are published on their own topic only when the occupancy of a
+ * zone changes and the new occupancy has been stable for "hold" frames, which
+ * filters out single frame detection flicker.  With tracking the membership is
+ * kept per track instead, a track enters once inside for "hold" frames and
+ * exits once outside, or lost, for "hold" frames, and an event is published
+ * for each track entering or exiting.
+ */
+static const int zone_grid = 32;
+
+enum zone_cell : uint8_t { zone_outside, zone_inside, zone_edge };
+
+struct zone {
+    std::string          name;
+    std::vector<float>   px, py;
+    float                x0, y0, x1, y1;
+    float                cell_w, cell_h;
+    std::vector<uint8_t> cells;
+    std::vector<uint8_t> classes;
+    bool                 center = false;
+
+    int              occupancy = 0;
+    int              pending   = 0;
+    int              frames    = 0;
+    std::vector<int> current;
+
+    // The tracks seen inside the zone by track id, with the frames they have
+    // been inside or outside since they last changed side.
+    struct member {
+        int  label;
+        int  inside;
+        int  outside;
+        bool entered;
+        bool seen;
+    };
+    std::map<int, member> members;
+};
+
+struct zone_set {
+    std::string       topic = "ZONE";
+    int               hold  = 3;
+    std::vector<zone> zones;
+
+    // The labels of the pipeline, with label_ids the events hold the indices.
+    const std::vector<std::string>* labels    = NULL;
+    bool                            label_ids = false;
+};
+
+static bool
+zone_polygon_test(const zone& z, float x, float y)
+{
+    bool   inside = false;
+    size_t n      = z.px.size();
+
+    for (size_t i = 0, j = n - 1; i < n; j = i++) {
+        if ((z.py[i] > y) != (z.py[j] > y) &&
+            x < (z.px[j] - z.px[i]) * (y - z.py[i]) / (z.py[j] - z.py[i]) +
+                    z.px[i]) {
+            inside = !inside;
+        }
+    }
+
+    return inside;
+}
+
+/**
+ * Conservative test whether the segment (ax, ay)-(bx, by) touches the cell
+ * rectangle, used only while building the grid.
+ */
+static bool
+zone_segment_cell(float ax, float ay, float bx, float by, float cx0, float cy0,
+                  float cx1, float cy1)
+{
+    if (std::max(ax, bx) < cx0 || std::min(ax, bx) > cx1) { return false; }
+    if (std::max(ay, by) < cy0 || std::min(ay, by) > cy1) { return false; }
+
+    float dx = bx - ax, dy = by - ay;
+    float s0 = dx * (cy0 - ay) - dy * (cx0 - ax);
+    float s1 = dx * (cy0 - ay) - dy * (cx1 - ax);
+    float s2 = dx * (cy1 - ay) - dy * (cx0 - ax);
+    float s3 = dx * (cy1 - ay) - dy * (cx1 - ax);
+
+    return !((s0 > 0 && s1 > 0 && s2 > 0 && s3 > 0) ||
+             (s0 < 0 && s1 < 0 && s2 < 0 && s3 < 0));
+}
+
+static void
+zone_build_grid(zone& z)
+{
+    z.x0     = *std::min_element(z.px.begin(), z.px.end());
+    z.x1     = *std::max_element(z.px.begin(), z.px.end());
+    z.y0     = *std::min_element(z.py.begin(), z.py.end());
+    z.y1     = *std::max_element(z.py.begin(), z.py.end());
+    z.cell_w = std::max(z.x1 - z.x0, 1e-6f) / zone_grid;
+    z.cell_h = std::max(z.y1 - z.y0, 1e-6f) / zone_grid;
+    z.cells.assign(zone_grid * zone_grid, zone_outside);
+
+    size_t n = z.px.size();
+    for (int row = 0; row < zone_grid; row++) {
+        for (int col = 0; col < zone_grid; col++) {
+            float cx0 = z.x0 + col * z.cell_w, cx1 = cx0 + z.cell_w;
+            float cy0 = z.y0 + row * z.cell_h, cy1 = cy0 + z.cell_h;
+            auto& cell = z.cells[row * zone_grid + col];
+
+            for (size_t i = 0, j = n - 1; i < n; j = i++) {
+                if (zone_segment_cell(z.px[j], z.py[j], z.px[i], z.py[i],
+                                      cx0, cy0, cx1, cy1)) {
+                    cell = zone_edge;
+                    break;
+                }
+            }
+
+            if (cell != zone_edge) {
+                bool inside = zone_polygon_test(z,
+                                                (cx0 + cx1) * 0.5f,
+                                                (cy0 + cy1) * 0.5f);
+                cell        = inside ? zone_inside : zone_outside;
+            }
+        }
+    }
+}
+
+static bool
+zone_contains(const zone& z, float x, float y)
+{
+    if (x < z.x0 || x > z.x1 || y < z.y0 || y > z.y1) { return false; }
+
+    int col = std::min(int((x - z.x0) / z.cell_w), zone_grid - 1);
+    int row = std::min(int((y - z.y0) / z.cell_h), zone_grid - 1);
+
+    switch (z.cells[row * zone_grid + col]) {
+    case zone_inside:
+        return true;
+    case zone_outside:
+        return false;
+    default:
+        return zone_polygon_test(z, x, y);
+    }
+}
+
+static int
+zone_load(zone_set& set, const char* path, VAALContext* vaal)
+{
+    json config;
+    if (load_json(path, config)) { return -1; }
+
+    int n_labels = std::max(vaal_label_count(vaal), 0);
+
+    try {
+        set.hold = config.value("hold", set.hold);
+
+        for (auto& item : config.at("zones")) {
+            zone z;
+            z.name   = item.at("name");
+            z.center = item.value("anchor", "bottom") == "center";
+            z.current.assign(n_labels, 0);
+
+            for (auto& point : item.at("points")) {
+                z.px.push_back(point.at(0));
+                z.py.push_back(point.at(1));
+            }
+
+            if (z.px.size() < 3) {
+                fprintf(stderr,
+                        "zone %s requires at least 3 points\n",
+                        z.name.c_str());
+                return -1;
+            }
+
+            if (item.contains("classes")) {
+                z.classes.assign(n_labels, 0);
+                for (auto& name : item["classes"]) {
+                    int i = label_index(vaal, name, path);
+                    if (i >= 0) { z.classes[i] = 1; }
+                }
+            }
+
+            zone_build_grid(z);
+            set.zones.push_back(std::move(z));
+        }
+    } catch (const json::exception& err) {
+        fprintf(stderr, "invalid zones %s: %s\n", path, err.what());
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Publishes the event of zone z, the counts are those of z.current.  The label
+ * of the track is given for the events of a tracked zone, or -1.
+ */
+static void
+zone_publish(zone_set&         set,
+             zmq::socket_t&    pub,
+             const zone&       z,
+             data::zone_event& event,
+             int               label)
+{
+    for (size_t i = 0; i < z.current.size(); i++) {
+        if (!z.current[i]) { continue; }
+        auto name          = label_name(*set.labels, set.label_ids, int(i));
+        event.counts[name] = z.current[i];
+    }
+
+    json payload = event;
+    if (label >= 0) {
+        payload["track"] = event.track;
+        payload["label"] = event.label;
+        if (set.label_ids) { payload["label"] = label; }
+    }
+    publish(pub, set.topic, payload.dump());
+}
+
+/**
+ * Returns whether the anchor point of the box is inside the zone and the box
+ * is of one of the zone's classes.
+ */
+static bool
+zone_box_inside(const zone& z, const VAALBox& box)
+{
+    size_t label = size_t(box.label);
+    if (!z.classes.empty() &&
+        (label >= z.classes.size() || !z.classes[label])) {
+        return false;
+    }
+
+    float x = (box.xmin + box.xmax) * 0.5f;
+    float y = z.center ? (box.ymin + box.ymax) * 0.5f : box.ymax;
+    return zone_contains(z, x, y);
+}
+
+/**
+ * Updates the members of the zone from the boxes and their track identities in
+ * ids, and publishes an event for every track which entered or exited.  Boxes
+ * without a track are ignored.  Returns the number of events published.
+ */
+static int
+zone_update_tracks(zone_set&      set,
+                   zmq::socket_t& pub,
+                   zone&          z,
+                   int64_t        timestamp,
+                   const VAALBox* boxes,
+                   size_t         n_boxes,
+                   const int*     ids)
+{
+    int events = 0;
+
+    for (auto& item : z.members) { item.second.seen = false; }
+
+    for (size_t i = 0; i < n_boxes; i++) {
+        if (!ids[i] || !zone_box_inside(z, boxes[i])) { continue; }
+
+        zone::member member = {
+            .label   = boxes[i].label,
+            .inside  = 0,
+            .outside = 0,
+            .entered = false,
+            .seen    = false,
+        };
+        z.members.emplace(ids[i], member).first->second.seen = true;
+    }
+
+    for (auto it = z.members.begin(); it != z.members.end();) {
+        zone::member& m = it->second;
+
+        if (m.seen) {
+            m.inside++;
+            m.outside = 0;
+        } else {
+            m.inside = 0;
+            m.outside++;
+        }
+
+        bool enter = m.seen && !m.entered && m.inside >= set.hold;
+        bool exit  = !m.seen && m.entered && m.outside >= set.hold;
+
+        if (!m.seen && !m.entered) {
+            it = z.members.erase(it);
+            continue;
+        }
+
+        if (!enter && !exit) {
+            it++;
+            continue;
+        }
+
+        size_t label = size_t(m.label);
+        int    delta = enter ? 1 : -1;
+        m.entered    = enter;
+        z.occupancy += delta;
+        if (label < z.current.size()) { z.current[label] += delta; }
+
+        data::zone_event event = {
+            .timestamp = timestamp,
+            .zone      = z.name,
+            .occupancy = z.occupancy,
+            .entered   = enter,
+            .exited    = exit,
+            .counts    = {},
+            .track     = it->first,
+            .label     = label_name(*set.labels, false, m.label),
+        };
+        zone_publish(set, pub, z, event, m.label);
+        events++;
+
+        it = exit ? z.members.erase(it) : std::next(it);
+    }
+
+    return events;
+}
+
+/**
+ * Updates the zone occupancy from the frame's boxes and publishes the events
+ * of every zone whose occupancy changed.  With the track identities of the
+ * boxes in ids the membership is kept per track, without them the entered and
+ * exited counts are derived from the change in occupancy.  Returns the number
+ * of events published.
+ */
+static int
+zone_update(zone_set&      set,
+            zmq::socket_t& pub,
+            int64_t        timestamp,
+            const VAALBox* boxes,
+            size_t         n_boxes,
+            const int*     ids)
+{
+    int events = 0;
+
+    for (auto& z : set.zones) {
+        if (ids) {
+            events += zone_update_tracks(set,
+                                         pub,
+                                         z,
+                                         timestamp,
+                                         boxes,
+                                         n_boxes,
+                                         ids);
+            continue;
+        }
+
+        int occupancy = 0;
+        std::fill(z.current.begin(), z.current.end(), 0);
+
+        for (size_t i = 0; i < n_boxes; i++) {
+            if (!zone_box_inside(z, boxes[i])) { continue; }
+
+            size_t label = size_t(boxes[i].label);
+            occupancy++;
+            if (label < z.current.size()) { z.current[label]++; }
+        }
+
+        if (occupancy != z.pending) {
+            z.pending = occupancy;
+            z.frames  = 0;
+        }
+
+        if (z.pending == z.occupancy || ++z.frames < set.hold) { continue; }
+
+        data::zone_event event = {
+            .timestamp = timestamp,
+            .zone      = z.name,
+            .occupancy = occupancy,
+            .entered   = std::max(occupancy - z.occupancy, 0),
+            .exited    = std::max(z.occupancy - occupancy, 0),
+        };
+
+        z.occupancy = occupancy;
+        events++;
+
+        zone_publish(set, pub, z, event, -1);
+    }
+
+    return events;
+}
+
+/**
+ * A lightweight IoU tracker which assigns identities to boxes across frames.
+ * Tracks are predicted forward with their last velocity then greedily matched
+ * to the boxes of the same class by descending IoU, unmatched boxes start new
+ * tracks and tracks which go unmatched for max_missed frames are dropped.
+ */
+struct track {
+    int     id;
+    int     label;
+    VAALBox box;
+    VAALBox last;
+    float   vx, vy;
+    int     missed;
+    bool    updated;
+};
+
+struct tracker {
+    float              iou_threshold = 0.3f;
+    int                max_missed    = 15;
+    int                next_id       = 1;
+    std::vector<track> tracks;
+    std::vector<int>   ids;
+
+    struct pair {
+        float  iou;
+        size_t track;
+        size_t box;
+    };
+    std::vector<pair> pairs;
+};
+
+static float
+box_iou(const VAALBox& a, const VAALBox& b)
+{
+    float w = std::min(a.xmax, b.xmax) - std::max(a.xmin, b.xmin);
+    float h = std::min(a.ymax, b.ymax) - std::max(a.ymin, b.ymin);
+    if (w <= 0 || h <= 0) { return 0.0f; }
+    float inter = w * h;
+    float area  = (a.xmax - a.xmin) * (a.ymax - a.ymin) +
+                 (b.xmax - b.xmin) * (b.ymax - b.ymin) - inter;
+    return area > 0 ? inter / area : 0.0f;
+}
+
+/**
+ * Matches the boxes to the current tracks and stores the track identity of
+ * every box into tracker.ids.
+ */
+static void
+tracker_update(tracker& tr, const VAALBox* boxes, size_t n_boxes)
+{
+    tr.pairs.clear();
+    tr.ids.assign(n_boxes, 0);
+
+    for (size_t t = 0; t < tr.tracks.size(); t++) {
+        track&  trk       = tr.tracks[t];
+        VAALBox predicted = trk.box;
+        float   steps     = float(trk.missed + 1);
+        predicted.xmin += trk.vx * steps;
+        predicted.xmax += trk.vx * steps;
+        predicted.ymin += trk.vy * steps;
+        predicted.ymax += trk.vy * steps;
+        trk.updated = false;
+
+        for (size_t b = 0; b < n_boxes; b++) {
+            if (boxes[b].label != trk.label) { continue; }
+            float iou = box_iou(predicted, boxes[b]);
+            if (iou >= tr.iou_threshold) { tr.pairs.push_back({iou, t, b}); }
+        }
+    }
+
+    std::sort(tr.pairs.begin(),
+              tr.pairs.end(),
+              [](const tracker::pair& a, const tracker::pair& b) {
+                  return a.iou > b.iou;
+              });
+
+    for (auto& p : tr.pairs) {
+        track& trk = tr.tracks[p.track];
+        if (trk.updated || tr.ids[p.box]) { continue; }
+
+        const VAALBox& box   = boxes[p.box];
+        float          steps = float(trk.missed + 1);
+        float          dx = (box.xmin + box.xmax - trk.box.xmin - trk.box.xmax);
+        float          dy = (box.ymin + box.ymax - trk.box.ymin - trk.box.ymax);
+
+        trk.vx        = dx * 0.5f / steps;
+        trk.vy        = dy * 0.5f / steps;
+        trk.last      = trk.box;
+        trk.box       = box;
+        trk.missed    = 0;
+        trk.updated   = true;
+        tr.ids[p.box] = trk.id;
+    }
+
+    for (auto it = tr.tracks.begin(); it != tr.tracks.end();) {
+        if (!it->updated && ++it->missed > tr.max_missed) {
+            it = tr.tracks.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    for (size_t b = 0; b < n_boxes; b++) {
+        if (tr.ids[b]) { continue; }
+        tr.ids[b] = tr.next_id++;
+        tr.tracks.push_back({
+            .id      = tr.ids[b],
+            .label   = boxes[b].label,
+            .box     = boxes[b],
+            .last    = boxes[b],
+            .vx      = 0,
+            .vy      = 0,
+            .missed  = 0,
+            .updated = false,
+        });
+    }
+}
+
+/**
+ * Virtual tripwires loaded from a JSON file with the --lines option, points
+ * are normalized to the frame like the detection boxes.
+ *
+ *     {
+ *         "interval": 60,
+ *         "lines": [
+ *             {
+ *                 "name": "gate",
+ *                 "points": [[0.5, 0.0], [0.5, 1.0]],
+ *                 "directions": [ "in", "out" ],
+ *                 "classes": [ "person", "car" ],
+ *                 "anchor": "bottom"
+ *             }
+ *         ]
+ *     }
+ *
+ * A tracked object crosses a line when the segment between the anchor point of
+ * its previous and current box intersects the line.  Crossings from the left
+ * to the right of the line, looking from the first point towards the second,
+ * are counted in the first direction and the others in the second direction.
+ * Each crossing publishes a small event with the updated count and the totals
+ * of every line are published every "interval" seconds.
+ */
+struct line {
+    std::string          name;
+    float                ax, ay, bx, by;
+    std::string          directions[2] = {"forward", "backward"};
+    std::vector<uint8_t> classes;
+    bool                 center = false;
+
+    std::vector<int64_t> counts[2];
+};
+
+struct line_set {
+    std::string       topic    = "LINE";
+    int64_t           interval = 60 * NSEC_PER_SEC;
+    int64_t           last     = 0; // timestamp of the latest frame
+    std::vector<line> lines;
+
+    // The labels of the pipeline, with label_ids the events hold the indices.
+    const std::vector<std::string>* labels    = NULL;
+    bool                            label_ids = false;
+};
+
+static int
+line_load(line_set& set, const char* path, VAALContext* vaal)
+{
+    json config;
+    if (load_json(path, config)) { return -1; }
+
+    int n_labels = std::max(vaal_label_count(vaal), 0);
+
+    try {
+        set.interval = int64_t(config.value("interval", 60.0) * NSEC_PER_SEC);
+
+        for (auto& item : config.at("lines")) {
+            line l;
+            l.name   = item.at("name");
+            l.center = item.value("anchor", "bottom") == "center";
+            l.ax     = item.at("points").at(0).at(0);
+            l.ay     = item.at("points").at(0).at(1);
+            l.bx     = item.at("points").at(1).at(0);
+            l.by     = item.at("points").at(1).at(1);
+            l.counts[0].assign(n_labels, 0);
+            l.counts[1].assign(n_labels, 0);
+
+            if (item.contains("directions")) {
+                l.directions[0] = item["directions"].at(0);
+                l.directions[1] = item["directions"].at(1);
+            }
+
+            if (item.contains("classes")) {
+                l.classes.assign(n_labels, 0);
+                for (auto& name : item["classes"]) {
+                    int i = label_index(vaal, name, path);
+                    if (i >= 0) { l.classes[i] = 1; }
+                }
+            }
+
+            set.lines.push_back(std::move(l));
+        }
+    } catch (const json::exception& err) {
+        fprintf(stderr, "invalid lines %s: %s\n", path, err.what());
+        return -1;
+    }
+
+    return 0;
+}
+
+static inline float
+line_side(const line& l, float x, float y)
+{
+    return (l.bx - l.ax) * (y - l.ay) - (l.by - l.ay) * (x - l.ax);
+}
+
+/**
+ * Returns 0 or 1 for the direction of the crossing of the segment p-q over the
+ * line or -1 if the segment does not cross the line.
+ */
+static int
+line_crossing(const line& l, float px, float py, float qx, float qy)
+{
+    float s0 = line_side(l, px, py);
+    float s1 = line_side(l, qx, qy);
+    if ((s0 < 0) == (s1 < 0) || s0 == 0) { return -1; }
+
+    float dx = qx - px, dy = qy - py;
+    float t0 = dx * (l.ay - py) - dy * (l.ax - px);
+    float t1 = dx * (l.by - py) - dy * (l.bx - px);
+    if ((t0 < 0) == (t1 < 0)) { return -1; }
+
+    return s0 < 0 ? 0 : 1;
+}
+
+static void
+line_update(line_set&      set,
+            zmq::socket_t& pub,
+            int64_t        timestamp,
+            const tracker& tr)
+{
+    for (auto& l : set.lines) {
+        for (auto& trk : tr.tracks) {
+            size_t label = size_t(trk.label);
+            if (!trk.updated || label >= l.counts[0].size()) { continue; }
+            if (!l.classes.empty() && !l.classes[label]) { continue; }
+
+            float px = (trk.last.xmin + trk.last.xmax) * 0.5f;
+            float qx = (trk.box.xmin + trk.box.xmax) * 0.5f;
+            float py = l.center ? (trk.last.ymin + trk.last.ymax) * 0.5f
+                                : trk.last.ymax;
+            float qy = l.center ? (trk.box.ymin + trk.box.ymax) * 0.5f
+                                : trk.box.ymax;
+
+            int dir = line_crossing(l, px, py, qx, qy);
+            if (dir < 0) { continue; }
+
+            data::line_event event = {
+                .timestamp = timestamp,
+                .line      = l.name,
+                .direction = l.directions[dir],
+                .label     = label_name(*set.labels, false, int(label)),
+                .track     = trk.id,
+                .count     = ++l.counts[dir][label],
+            };
+
+            json payload = event;
+            if (set.label_ids) { payload["label"] = int(label); }
+            publish(pub, set.topic, payload.dump());
+        }
+    }
+
+    set.last = timestamp;
+}
+
+/**
+ * Publishes the counts of every line, called by the reactor every interval and
+ * timestamped with the most recent frame.
+ */
+static void
+line_totals(line_set& set, zmq::socket_t& pub)
+{
+    for (auto& l : set.lines) {
+        data::line_totals totals = {
+            .timestamp = set.last,
+            .line      = l.name,
+        };
+
+        for (int dir = 0; dir < 2; dir++) {
+            auto& counts = totals.totals[l.directions[dir]];
+            for (size_t i = 0; i < l.counts[dir].size(); i++) {
+                if (!l.counts[dir][i]) { continue; }
+                auto name    = label_name(*set.labels, set.label_ids, int(i));
+                counts[name] = l.counts[dir][i];
+            }
+        }
+
+        json payload = totals;
+        publish(pub, set.topic, payload.dump());
+    }
+}
+
+/**
+ * The frame being processed, its DMA buffer remains valid until release() is
+ * called which returns the frame to its source through the done callback.
+ */
+struct input_frame {
+    int         fd;
+    const void* memory;
+    const char* path;
+    uint32_t    fourcc;
+    int         width;
+    int         height;
+    int         stride; // bytes per row of the first plane, 0 if unknown
+    int64_t     timestamp;
+    int64_t     serial;
+    void*       source;
+    int         index;
+    void (*done)(input_frame& frame);
+
+    // Set by sources whose frames may be held after processing.
+    bool hold;
+
+    void
+    release()
+    {
+        if (!done) { return; }
+        auto fn = done;
+        done    = NULL;
+        fn(*this);
+    }
+};
+
+/**
+ * Loads the frame, or the region of interest of the frame given as x, y, width
+ * and height in pixels, into the model's input tensor.  Frames without a DMA
+ * buffer are loaded from memory by the CPU and image files are decoded.
+ */
+static int
+load_frame(VAALContext* vaal, const input_frame& frame, const int32_t* roi)
+{
+    if (frame.path) {
+        return vaal_load_image_file(vaal, NULL, frame.path, roi, 0);
+    }
+
+    if (frame.fd < 0) {
+        return vaal_load_frame_memory(vaal,
+                                      NULL,
+                                      frame.memory,
+                                      frame.fourcc,
+                                      frame.width,
+                                      frame.height,
+                                      roi,
+                                      0);
+    }
+
+    return vaal_load_frame_dmabuf(vaal,
+                                  NULL,
+                                  frame.fd,
+                                  frame.fourcc,
+                                  frame.width,
+                                  frame.height,
+                                  roi,
+                                  0);
+}
+
+/**
+ * The ensemble runs additional models, or the primary model over tiles of the
+ * frame, on the same loaded frame and merges every prediction with Weighted
+ * Box Fusion.  Rather than discarding overlapping boxes as NMS does, WBF
+ * averages the coordinates of each cluster of matching boxes weighted by their
+ * scores and rescales the cluster score by how many predictions agreed.
+ *
+ * All the ensemble models must share the label table of the primary model.
+ */
+struct ensemble_member {
+    VAALContext* vaal;
+    int          tile;
+};
+
+struct ensemble {
+    float                        iou_threshold = 0.55f;
+    int                          tile_cols     = 0;
+    int                          tile_rows     = 0;
+    float                        tile_overlap  = 0.1f;
+    std::vector<ensemble_member> members;
+    std::vector<VAALBox>         pool;
+    std::vector<VAALBox>         scratch;
+
+    // Frame size of the last run, which places the tiles.
+    int width  = 0;
+    int height = 0;
+
+    // Flat arrays of the fused clusters, sums are weighted by score.
+    std::vector<float> sx0, sy0, sx1, sy1, ssum;
+    std::vector<float> x0, y0, x1, y1;
+    std::vector<int>   label, count;
+
+    int64_t ensemble_ns = 0;
+    int64_t fusion_ns   = 0;
+};
+
+/**
+ * Computes the region of interest as x, y, width, height in pixels for a tile
+ * of the frame, neighbouring tiles overlap so objects on the seams are seen
+ * whole by at least one tile.
+ */
+static void
+ensemble_tile(const ensemble& ens, int tile, int width, int height,
+              int32_t roi[4])
+{
+    int   col = tile % ens.tile_cols;
+    int   row = tile / ens.tile_cols;
+    float tw  = float(width) / ens.tile_cols;
+    float th  = float(height) / ens.tile_rows;
+    float ox  = tw * ens.tile_overlap * 0.5f;
+    float oy  = th * ens.tile_overlap * 0.5f;
+
+    int x0 = std::max(int(col * tw - ox), 0);
+    int y0 = std::max(int(row * th - oy), 0);
+    int x1 = std::min(int((col + 1) * tw + ox), width);
+    int y1 = std::min(int((row + 1) * th + oy), height);
+
+    roi[0] = x0;
+    roi[1] = y0;
+    roi[2] = x1 - x0;
+    roi[3] = y1 - y0;
+}
+
+static int
+ensemble_parse_tiles(ensemble& ens, const char* grid)
+{
+    if (sscanf(grid, "%dx%d", &ens.tile_cols, &ens.tile_rows) != 2 ||
+        ens.tile_cols < 1 || ens.tile_rows < 1) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Runs every ensemble member on the frame and collects their boxes into the
+ * pool along with the primary model boxes.
+ */
+static int
+ensemble_run(ensemble&          ens,
+             VAALContext*       primary,
+             const VAALBox*     boxes,
+             size_t             n_boxes,
+             const input_frame& frame)
+{
+    int width  = frame.width;
+    int height = frame.height;
+
+    ens.width  = width;
+    ens.height = height;
+    ens.pool.assign(boxes, boxes + n_boxes);
+
+    for (auto& member : ens.members) {
+        VAALContext* vaal = member.vaal ? member.vaal : primary;
+        int32_t      roi[4];
+        if (member.tile >= 0) {
+            ensemble_tile(ens, member.tile, width, height, roi);
+        }
+
+        int err = load_frame(vaal, frame, member.tile >= 0 ? roi : NULL);
+        if (!err) { err = vaal_run_model(vaal); }
+        size_t n = 0;
+        if (!err) {
+            err = vaal_boxes(vaal, ens.scratch.data(), ens.scratch.size(), &n);
+        }
+        if (err) {
+            fprintf(stderr,
+                    "failed to run ensemble model: %s\n",
+                    vaal_strerror(VAALError(err)));
+            return -1;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            VAALBox box = ens.scratch[i];
+            if (member.tile >= 0) {
+                float sx = float(roi[2]) / width, ox = float(roi[0]) / width;
+                float sy = float(roi[3]) / height, oy = float(roi[1]) / height;
+                box.xmin = ox + box.xmin * sx;
+                box.xmax = ox + box.xmax * sx;
+                box.ymin = oy + box.ymin * sy;
+                box.ymax = oy + box.ymax * sy;
+            }
+            ens.pool.push_back(box);
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Counts the predictions which could have seen the box: the full frame models
+ * and the tiles whose region contains the box.
+ */
+static int
+ensemble_models(const ensemble& ens, const VAALBox& box)
+{
+    int models = 1;
+    for (auto& member : ens.members) {
+        if (member.tile < 0) {
+            models++;
+            continue;
+        }
+
+        int32_t roi[4];
+        ensemble_tile(ens, member.tile, ens.width, ens.height, roi);
+        if (box.xmin >= float(roi[0]) / ens.width &&
+            box.ymin >= float(roi[1]) / ens.height &&
+            box.xmax <= float(roi[0] + roi[2]) / ens.width &&
+            box.ymax <= float(roi[1] + roi[3]) / ens.height) {
+            models++;
+        }
+    }
+    return models;
+}
+
+/**
+ * Weighted Box Fusion of the pooled boxes into boxes, returns the number of
+ * fused boxes above threshold.  Clusters are matched by IoU against their
+ * current fused box.
+ */
+static size_t
+ensemble_fuse(ensemble& ens, VAALBox* boxes, size_t max_boxes, float threshold)
+{
+    std::sort(ens.pool.begin(),
+              ens.pool.end(),
+              [](const VAALBox& a, const VAALBox& b) {
+                  return a.score > b.score;
+              });
+
+    for (auto* v : {&ens.sx0, &ens.sy0, &ens.sx1, &ens.sy1, &ens.ssum, &ens.x0,
+                    &ens.y0, &ens.x1, &ens.y1}) {
+        v->clear();
+    }
+    ens.label.clear();
+    ens.count.clear();
+
+    for (const VAALBox& box : ens.pool) {
+        size_t n     = ens.x0.size();
+        int    match = -1;
+        float  best  = ens.iou_threshold;
+        float  area  = (box.xmax - box.xmin) * (box.ymax - box.ymin);
+
+        for (size_t c = 0; c < n; c++) {
+            if (ens.label[c] != box.label) { continue; }
+            float w = std::min(ens.x1[c], box.xmax) -
+                      std::max(ens.x0[c], box.xmin);
+            float h = std::min(ens.y1[c], box.ymax) -
+                      std::max(ens.y0[c], box.ymin);
+            if (w <= 0 || h <= 0) { continue; }
+            float inter = w * h;
+            float other = (ens.x1[c] - ens.x0[c]) * (ens.y1[c] - ens.y0[c]);
+            float iou   = inter / (area + other - inter);
+            if (iou > best) {
+                best  = iou;
+                match = int(c);
+            }
+        }
+
+        float s = box.score;
+        if (match < 0) {
+            ens.sx0.push_back(box.xmin * s);
+            ens.sy0.push_back(box.ymin * s);
+            ens.sx1.push_back(box.xmax * s);
+            ens.sy1.push_back(box.ymax * s);
+            ens.ssum.push_back(s);
+            ens.x0.push_back(box.xmin);
+            ens.y0.push_back(box.ymin);
+            ens.x1.push_back(box.xmax);
+            ens.y1.push_back(box.ymax);
+            ens.label.push_back(box.label);
+            ens.count.push_back(1);
+            continue;
+        }
+
+        size_t c = size_t(match);
+        ens.sx0[c] += box.xmin * s;
+        ens.sy0[c] += box.ymin * s;
+        ens.sx1[c] += box.xmax * s;
+        ens.sy1[c] += box.ymax * s;
+        ens.ssum[c] += s;
+        ens.count[c]++;
+        ens.x0[c] = ens.sx0[c] / ens.ssum[c];
+        ens.y0[c] = ens.sy0[c] / ens.ssum[c];
+        ens.x1[c] = ens.sx1[c] / ens.ssum[c];
+        ens.y1[c] = ens.sy1[c] / ens.ssum[c];
+    }
+
+    /**
+     * The fused score is the average score of the cluster scaled down when
+     * fewer predictions than could have seen the box contributed to the
+     * cluster, a tile which does not contain the box is not expected to agree.
+     * The scaling can drop clusters below the score threshold.
+     */
+    size_t n = ens.x0.size();
+    ens.pool.clear();
+    for (size_t c = 0; c < n; c++) {
+        VAALBox box = {};
+        box.xmin    = ens.x0[c];
+        box.ymin    = ens.y0[c];
+        box.xmax    = ens.x1[c];
+        box.ymax    = ens.y1[c];
+        box.label   = ens.label[c];
+
+        float models = float(ensemble_models(ens, box));
+        float agree  = std::min(float(ens.count[c]), models);
+        box.score    = ens.ssum[c] / ens.count[c] * agree / models;
+        if (box.score >= threshold) { ens.pool.push_back(box); }
+    }
+    n = ens.pool.size();
+
+    std::sort(ens.pool.begin(),
+              ens.pool.end(),
+              [](const VAALBox& a, const VAALBox& b) {
+                  return a.score > b.score;
+              });
+
+    n = std::min(n, max_boxes);
+    std::copy(ens.pool.begin(), ens.pool.begin() + n, boxes);
+    return n;
+}
+
+/**
+ * The cascade runs a classifier model on crops of the detected boxes while the
+ * frame is still held, attaching the classifier's label and score to each
+ * object.  Crops are cut by the ROI argument of vaal_load_frame_dmabuf so the
+ * frame is never copied, only boxes of the selected detection classes are
+ * classified and at most max_crops per frame, highest scores first.
+ */
+struct cascade {
+    VAALContext*         vaal      = NULL;
+    std::vector<uint8_t> classes;
+    size_t               max_crops = 8;
+    float                margin    = 0.1f;
+    std::vector<int>     labels;
+    std::vector<float>   scores;
+    std::vector<size_t>  order;
+    int64_t              classify_ns = 0;
+};
+
+/**
+ * Reads the classifier output as the best class and its score, logits are
+ * converted to probabilities with a softmax.
+ */
+static int
+cascade_argmax(VAALContext* vaal, int& label, float& score)
+{
+    NNTensor*           tensor = vaal_output_tensor(vaal, 0);
+    native::tensor_view view;
+    if (!tensor || native::tensor_map(tensor, view)) { return -1; }
+
+    int   n    = nn_tensor_volume(tensor);
+    float best = -INFINITY, low = INFINITY, sum = 0.0f;
+    label      = 0;
+
+    for (int i = 0; i < n; i++) {
+        float v = native::load(view, i);
+        low     = std::min(low, v);
+        if (v > best) {
+            best  = v;
+            label = i;
+        }
+    }
+
+    if (low < 0.0f || best > 1.0f) {
+        for (int i = 0; i < n; i++) {
+            sum += expf(native::load(view, i) - best);
+        }
+        score = 1.0f / sum;
+    } else {
+        score = best;
+    }
+
+    nn_tensor_unmap(tensor);
+    return 0;
+}
+
+static int
+cascade_run(cascade&           casc,
+            const VAALBox*     boxes,
+            size_t             n_boxes,
+            const input_frame& frame)
+{
+    int64_t start  = vaal_clock_now();
+    int     width  = frame.width;
+    int     height = frame.height;
+
+    casc.labels.assign(n_boxes, -1);
+    casc.scores.assign(n_boxes, 0.0f);
+    casc.order.clear();
+
+    for (size_t i = 0; i < n_boxes; i++) {
+        size_t label = size_t(boxes[i].label);
+        if (!casc.classes.empty() &&
+            (label >= casc.classes.size() || !casc.classes[label])) {
+            continue;
+        }
+        casc.order.push_back(i);
+    }
+
+    std::sort(casc.order.begin(),
+              casc.order.end(),
+              [boxes](size_t a, size_t b) {
+                  return boxes[a].score > boxes[b].score;
+              });
+    if (casc.order.size() > casc.max_crops) {
+        casc.order.resize(casc.max_crops);
+    }
+
+    for (size_t i : casc.order) {
+        const VAALBox& box = boxes[i];
+        float          mx  = (box.xmax - box.xmin) * casc.margin * 0.5f;
+        float          my  = (box.ymax - box.ymin) * casc.margin * 0.5f;
+        int x0 = std::max(int((box.xmin - mx) * width), 0);
+        int y0 = std::max(int((box.ymin - my) * height), 0);
+        int x1 = std::min(int((box.xmax + mx) * width), width);
+        int y1 = std::min(int((box.ymax + my) * height), height);
+        if (x1 - x0 < 8 || y1 - y0 < 8) { continue; }
+
+        int32_t roi[4] = {x0, y0, x1 - x0, y1 - y0};
+        int     err    = load_frame(casc.vaal, frame, roi);
+        if (!err) { err = vaal_run_model(casc.vaal); }
+        if (err) {
+            fprintf(stderr,
+                    "failed to run classifier: %s\n",
+                    vaal_strerror(VAALError(err)));
+            return -1;
+        }
+
+        if (cascade_argmax(casc.vaal, casc.labels[i], casc.scores[i])) {
+            fprintf(stderr, "failed to read classifier output\n");
+            return -1;
+        }
+    }
+
+    casc.classify_ns = vaal_clock_now() - start;
+    return 0;
+}
+
+/**
+ * The gate runs a small presence model on every frame and only lets the frame
+ * through to the full model when one of the gate classes is detected above the
+ * threshold.  Once open the gate stays open while the gate classes are seen
+ * above the lower threshold and for hold frames after, which prevents the
+ * full model from flickering on and off at the edge of detection.
+ *
+ * While the gate is closed the results are the gate model's own boxes, their
+ * labels are mapped by name onto the full model's labels so every later stage
+ * sees a single label table.
+ */
+struct gatekeeper {
+    VAALContext*         vaal      = NULL;
+    std::string          name;
+    std::vector<uint8_t> classes;
+    std::vector<int>     remap;
+    float                threshold = 0.4f;
+    float                low       = 0.25f;
+    float                min_score = 0.5f;
+    int                  hold      = 15;
+    int                  remaining = 0;
+    std::vector<VAALBox> boxes;
+    size_t               n_boxes = 0;
+    int64_t              gate_ns = 0;
+};
+
+static void
+gate_init(gatekeeper&  g,
+          VAALContext* vaal,
+          const char*  path,
+          const char*  classes)
+{
+    const char* base = strrchr(path, '/');
+    g.name           = base ? base + 1 : path;
+
+    int n_gate = std::max(vaal_label_count(g.vaal), 0);
+    g.remap.assign(n_gate, -1);
+    for (int i = 0; i < n_gate; i++) {
+        const char* label = vaal_label(g.vaal, i);
+        if (!label) { continue; }
+        int n = vaal_label_count(vaal);
+        for (int j = 0; j < n; j++) {
+            const char* other = vaal_label(vaal, j);
+            if (other && !strcmp(label, other)) { g.remap[i] = j; }
+        }
+    }
+
+    if (classes) { label_list(g.vaal, classes, "--gate-classes", g.classes); }
+}
+
+/**
+ * Runs the gate model on the frame and returns 1 if the full model should run
+ * on this frame, 0 if not or -1 on error.
+ */
+static int
+gate_run(gatekeeper& g, const input_frame& frame)
+{
+    int64_t start = vaal_clock_now();
+
+    int err = load_frame(g.vaal, frame, NULL);
+    if (!err) { err = vaal_run_model(g.vaal); }
+    if (!err) {
+        err = vaal_boxes(g.vaal, g.boxes.data(), g.boxes.size(), &g.n_boxes);
+    }
+    if (err) {
+        fprintf(stderr,
+                "failed to run gate model: %s\n",
+                vaal_strerror(VAALError(err)));
+        return -1;
+    }
+
+    float best = 0.0f;
+    for (size_t i = 0; i < g.n_boxes; i++) {
+        size_t label = size_t(g.boxes[i].label);
+        if (!g.classes.empty() &&
+            (label >= g.classes.size() || !g.classes[label])) {
+            continue;
+        }
+        best = std::max(best, g.boxes[i].score);
+    }
+
+    if (best >= g.threshold || (g.remaining && best >= g.low)) {
+        g.remaining = g.hold + 1;
+    } else if (g.remaining) {
+        g.remaining--;
+    }
+
+    g.gate_ns = vaal_clock_now() - start;
+    return g.remaining ? 1 : 0;
+}
+
+/**
+ * Copies the gate boxes above the detection threshold which exist in the full
+ * model's label table into boxes and returns their number.
+ */
+static size_t
+gate_boxes(const gatekeeper& g, VAALBox* boxes, size_t max_boxes)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < g.n_boxes && n < max_boxes; i++) {
+        size_t label = size_t(g.boxes[i].label);
+        if (label >= g.remap.size() || g.remap[label] < 0) { continue; }
+        if (g.boxes[i].score < g.min_score) { continue; }
+        boxes[n]       = g.boxes[i];
+        boxes[n].label = g.remap[label];
+        n++;
+    }
+    return n;
+}
+
+/**
+ * The frame cache holds the last capacity frames after they are processed so
+ * crops of the detected objects can be requested through the control channel
+ * after the frame's lifespan at the source has run out.  Only the sources
+ * which set hold, the videostream frames, are held since the v4l2 buffers are
+ * needed back by the driver and the raw input reuses its buffer.
+ */
+struct frame_cache {
+    size_t                  capacity = 0;
+    std::deque<input_frame> frames;
+};
+
+/**
+ * Takes ownership of the frame, releasing the oldest frame once the cache is
+ * full.
+ */
+static void
+frame_hold(frame_cache& cache, input_frame& frame)
+{
+    if (!frame.hold || !cache.capacity) {
+        frame.release();
+        return;
+    }
+
+    cache.frames.push_back(frame);
+    frame.done = NULL;
+
+    while (cache.frames.size() > cache.capacity) {
+        cache.frames.front().release();
+        cache.frames.pop_front();
+    }
+}
+
+static input_frame*
+frame_find(frame_cache& cache, int64_t serial)
+{
+    for (auto& frame : cache.frames) {
+        if (frame.serial == serial) { return &frame; }
+    }
+    return NULL;
+}
+
+static void
+frame_clear(frame_cache& cache)
+{
+    for (auto& frame : cache.frames) { frame.release(); }
+    cache.frames.clear();
+}
+
+/**
+ * The layout of the frame formats whose pixels are read by the CPU: bytes per
+ * pixel of the first plane, the pixel alignment of the subsampled chroma and
+ * whether an interleaved chroma plane follows at half the height.
+ */
+struct frame_layout {
+    int  bpp;
+    int  align;
+    bool nv;
+};
+
+static int
+frame_layout_of(uint32_t fourcc, frame_layout& layout)
+{
+    switch (fourcc) {
+    case v4l2_fourcc('N', 'V', '1', '2'):
+    case v4l2_fourcc('N', 'V', '2', '1'):
+        layout = {.bpp = 1, .align = 2, .nv = true};
+        return 0;
+    case v4l2_fourcc('Y', 'U', 'Y', 'V'):
+    case v4l2_fourcc('Y', 'U', 'Y', '2'):
+    case v4l2_fourcc('U', 'Y', 'V', 'Y'):
+        layout = {.bpp = 2, .align = 2, .nv = false};
+        return 0;
+    case v4l2_fourcc('R', 'G', 'B', '3'):
+    case v4l2_fourcc('B', 'G', 'R', '3'):
+        layout = {.bpp = 3, .align = 1, .nv = false};
+        return 0;
+    case v4l2_fourcc('R', 'G', 'B', 'A'):
+    case v4l2_fourcc('B', 'G', 'R', 'A'):
+    case v4l2_fourcc('R', 'G', 'B', 'X'):
+    case v4l2_fourcc('B', 'G', 'R', 'X'):
+        layout = {.bpp = 4, .align = 1, .nv = false};
+        return 0;
+    case v4l2_fourcc('G', 'R', 'E', 'Y'):
+        layout = {.bpp = 1, .align = 1, .nv = false};
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/**
+ * The pixel rectangle x0, y0 to x1, y1 covering the box, in coordinates
+ * normalized to the frame, aligned for the subsampled chroma.  Returns -1 for
+ * an empty rectangle.
+ */
+static int
+frame_region(const input_frame&  frame,
+             const frame_layout& layout,
+             const data::box&    box,
+             int                 rect[4])
+{
+    int w  = frame.width;
+    int h  = frame.height;
+    int ax = layout.align - 1;
+    int ay = layout.nv ? 1 : 0;
+
+    rect[0] = std::max(0, int(floorf(box.xmin * w))) & ~ax;
+    rect[1] = std::max(0, int(floorf(box.ymin * h))) & ~ay;
+    rect[2] = std::min(w, (int(ceilf(box.xmax * w)) + ax) & ~ax);
+    rect[3] = std::min(h, (int(ceilf(box.ymax * h)) + ay) & ~ay);
+    return rect[2] > rect[0] && rect[3] > rect[1] ? 0 : -1;
+}
+
+/**
+ * Maps the frame's DMA buffer for reading.  Rows are addressed with the frame's
+ * stride, which must be known, and the interleaved chroma plane of the NV
+ * formats is expected right after the stride by height luma plane.  Returns
+ * NULL or the error message.
+ */
+static const char*
+frame_map(const input_frame&  frame,
+          const frame_layout& layout,
+          const uint8_t**     data,
+          size_t*             size)
+{
+    if (frame.fd < 0) { return "frame has no dma buffer"; }
+    if (frame.stride < frame.width * layout.bpp) {
+        return "frame stride unknown";
+    }
+
+    size_t plane = size_t(frame.stride) * frame.height;
+    size_t need  = layout.nv ? plane * 3 / 2 : plane;
+    off_t  end   = lseek(frame.fd, 0, SEEK_END);
+    if (end < 0 || size_t(end) < need) {
+        return "frame buffer smaller than its format";
+    }
+
+    void* map = mmap(NULL, end, PROT_READ, MAP_SHARED, frame.fd, 0);
+    if (map == MAP_FAILED) { return "failed to map the frame"; }
+
+    struct dma_buf_sync sync = {DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ};
+    ioctl(frame.fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+    *data = (const uint8_t*) map;
+    *size = end;
+    return NULL;
+}
+
+static void
+frame_unmap(const input_frame& frame, const uint8_t* data, size_t size)
+{
+    struct dma_buf_sync sync = {DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ};
+    ioctl(frame.fd, DMA_BUF_IOCTL_SYNC, &sync);
+    munmap((void*) data, size);
+}
+
+/**
+ * Copies the box, in coordinates normalized to the frame, out of the frame's
+ * DMA buffer into pixels in the frame's format with rows of the crop width,
+ * the frame's stride padding is not copied.
+ * Crops of the subsampled YUV formats are aligned to even pixels.  Returns
+ * NULL or the error message.
+ */
+static const char*
+frame_crop(const input_frame& frame,
+           const data::box&   box,
+           json&              info,
+           std::string&       pixels)
+{
+    frame_layout layout;
+    int          rect[4];
+
+    if (frame_layout_of(frame.fourcc, layout)) {
+        return "unsupported frame format";
+    }
+    if (frame_region(frame, layout, box, rect)) { return "empty crop"; }
+
+    const uint8_t* data;
+    size_t         size;
+    const char*    error = frame_map(frame, layout, &data, &size);
+    if (error) { return error; }
+
+    size_t stride = size_t(frame.stride);
+    size_t row    = size_t(rect[2] - rect[0]) * layout.bpp;
+    size_t start  = size_t(rect[0]) * layout.bpp;
+
+    pixels.clear();
+    for (int y = rect[1]; y < rect[3]; y++) {
+        pixels.append((const char*) data + y * stride + start, row);
+    }
+    if (layout.nv) {
+        const uint8_t* uv = data + stride * frame.height;
+        for (int y = rect[1] / 2; y < rect[3] / 2; y++) {
+            pixels.append((const char*) uv + y * stride + start, row);
+        }
+    }
+
+    frame_unmap(frame, data, size);
+
+    info = {
+        {"serial", frame.serial},
+        {"timestamp", frame.timestamp},
+        {"format", std::string((const char*) &frame.fourcc, 4)},
+        {"x", rect[0]},
+        {"y", rect[1]},
+        {"width", rect[2] - rect[0]},
+        {"height", rect[3] - rect[1]},
+    };
+    return NULL;
+}
+
+/**
+ * The snapshot pool encodes a JPEG of the frame when one of the classes
+ * appears, which is when the class was not detected in the previous frame, or
+ * when a zone event fires.  The frame, already locked by the capture thread,
+ * is handed over to one of the worker threads instead of being copied and the
+ * encoded snapshots are published by the reactor thread on the snapshot topic.
+ * Snapshots are dropped when queue frames already wait for a worker so the
+ * held frames stay bounded.  Like the frame cache only the sources which set
+ * hold can be snapshot.
+ */
+struct snapshot_job {
+    input_frame    frame;
+    data::snapshot info;
+};
+
+struct snapshot_pool {
+    std::string          topic   = "SNAPSHOT";
+    std::vector<uint8_t> classes;
+    bool                 zones   = false;
+    bool                 crop    = false;
+    int                  quality = 85;
+    size_t               jobs    = 2;
+    size_t               queue   = 4;
+    int                  event   = -1;
+    int64_t              dropped = 0;
+
+    // Classes detected in the previous frame, used by the reactor thread.
+    std::vector<uint8_t> present;
+
+    std::mutex                lock;
+    std::condition_variable   ready;
+    std::deque<snapshot_job>  pending;
+    std::vector<snapshot_job> done;
+    std::vector<std::string>  images;
+    std::vector<std::thread>  workers;
+    bool                      stop = false;
+};
+
+/**
+ * Checks the triggers of the frame's boxes, and the number of zone events it
+ * caused, and hands the frame over to the workers if one fired.  Returns
+ * whether the frame was taken.
+ */
+static bool
+snapshot_trigger(snapshot_pool&                  pool,
+                 input_frame&                    frame,
+                 const std::vector<std::string>& labels,
+                 const VAALBox*                  boxes,
+                 size_t                          n_boxes,
+                 int                             zone_events)
+{
+    std::vector<uint8_t> present(pool.classes.size(), 0);
+    const VAALBox*       trigger = NULL;
+
+    for (size_t i = 0; i < n_boxes; i++) {
+        size_t label = size_t(boxes[i].label);
+        if (label >= pool.classes.size() || !pool.classes[label]) { continue; }
+        bool seen = label < pool.present.size() && pool.present[label];
+        if (!trigger && !seen) { trigger = &boxes[i]; }
+        present[label] = 1;
+    }
+    pool.present.swap(present);
+
+    if (!frame.hold || (!trigger && !(pool.zones && zone_events))) {
+        return false;
+    }
+
+    data::box bbox = {.xmin = 0.0f, .xmax = 1.0f, .ymin = 0.0f, .ymax = 1.0f};
+    if (trigger && pool.crop) {
+        bbox = {
+            .xmin = trigger->xmin,
+            .xmax = trigger->xmax,
+            .ymin = trigger->ymin,
+            .ymax = trigger->ymax,
+        };
+    }
+
+    std::string reason = trigger ? label_text(labels, trigger->label) : "zone";
+
+    snapshot_job job = {
+        .frame = frame,
+        .info =
+            {
+                .timestamp = frame.timestamp,
+                .serial    = frame.serial,
+                .reason    = reason,
+                .bbox      = bbox,
+                .width     = 0,
+                .height    = 0,
+                .encode_ns = 0,
+                .size      = 0,
+            },
+    };
+
+    {
+        std::lock_guard<std::mutex> guard(pool.lock);
+        if (pool.pending.size() >= pool.queue) {
+            pool.dropped++;
+            return false;
+        }
+        pool.pending.push_back(job);
+    }
+
+    frame.done = NULL;
+    pool.ready.notify_one();
+    return true;
+}
+
+/**
+ * The result ring publishes every result into shared memory for readers on the
+ * same device, see detect_ring.h for the layout and the reader API.
+ */
+struct result_ring {
+    const char*         name     = NULL;
+    uint32_t            capacity = 64;
+    int                 fd       = -1;
+    size_t              size     = 0;
+    detect_ring_header* header   = NULL;
+    detect_ring_record* records  = NULL;
+};
+
+static void
+ring_close(result_ring& ring)
+{
+    if (ring.header) { munmap(ring.header, ring.size); }
+    if (ring.fd >= 0) { close(ring.fd); }
+    if (ring.name) { shm_unlink((std::string("/") + ring.name).c_str()); }
+
+    ring.header  = NULL;
+    ring.records = NULL;
+    ring.fd      = -1;
+}
+
+/**
+ * Creates the ring in /dev/shm, replacing a ring left behind by a previous run,
+ * and stores the model's labels in its label table.
+ */
+static int
+ring_create(result_ring& ring, VAALContext* vaal)
+{
+    std::string path   = std::string("/") + ring.name;
+    uint32_t    labels = std::max(vaal_label_count(vaal), 0);
+
+    size_t labels_offset  = sizeof(detect_ring_header);
+    size_t records_offset = labels_offset + labels * DETECT_RING_LABEL_SIZE;
+    records_offset        = (records_offset + 63) & ~size_t(63);
+    ring.size = records_offset + ring.capacity * sizeof(detect_ring_record);
+
+    shm_unlink(path.c_str());
+    ring.fd = shm_open(path.c_str(),
+                       O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+                       0644);
+    if (ring.fd < 0 || ftruncate(ring.fd, ring.size)) {
+        fprintf(stderr,
+                "failed to create result ring %s: %s\n",
+                path.c_str(),
+                strerror(errno));
+        ring_close(ring);
+        return -1;
+    }
+
+    void* map =
+        mmap(NULL, ring.size, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr,
+                "failed to map result ring %s: %s\n",
+                path.c_str(),
+                strerror(errno));
+        ring_close(ring);
+        return -1;
+    }
+
+    ring.header  = (detect_ring_header*) map;
+    ring.records = (detect_ring_record*) ((char*) map + records_offset);
+
+    char* table = (char*) map + labels_offset;
+    for (uint32_t i = 0; i < labels; i++) {
+        const char* label = vaal_label(vaal, int(i));
+        strncpy(table + i * DETECT_RING_LABEL_SIZE,
+                label ? label : "",
+                DETECT_RING_LABEL_SIZE - 1);
+    }
+
+    /**
+     * The magic is written last so a reader never accepts a ring which is
+     * still being initialized.
+     */
+    detect_ring_header* header = ring.header;
+    header->version            = DETECT_RING_VERSION;
+    header->capacity           = ring.capacity;
+    header->record_size        = sizeof(detect_ring_record);
+    header->max_objects        = DETECT_RING_MAX_OBJECTS;
+    header->label_count        = labels;
+    header->label_size         = DETECT_RING_LABEL_SIZE;
+    header->labels_offset      = labels_offset;
+    header->records_offset     = records_offset;
+    header->size               = ring.size;
+    __atomic_store_n(&header->magic, DETECT_RING_MAGIC, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+/**
+ * The changes publish policy only sends a result when the detections differ
+ * from the last result sent: when the number of boxes changes or a box has no
+ * counterpart of the same label and track with at least min_iou overlap and a
+ * score within max_score of it.  A keyframe is still sent every keyframe
+ * nanoseconds so subscribers which join later receive the current state.
+ */
+struct publish_policy {
+    bool    changes   = false;
+    float   min_iou   = 0.9f;
+    float   max_score = 0.1f;
+    int64_t keyframe  = NSEC_PER_SEC;
+
+    int64_t              sent       = -1;
+    int64_t              suppressed = 0;
+    std::vector<VAALBox> boxes;
+    std::vector<int>     tracks;
+    std::vector<bool>    matched;
+};
+
+static int
+publish_parse(publish_policy& policy, const char* name)
+{
+    if (!strcmp(name, "all")) {
+        policy.changes = false;
+    } else if (!strcmp(name, "changes")) {
+        policy.changes = true;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Returns whether the result of the first n_boxes of boxes should be sent and
+ * if so remembers them as the last result sent.  The track ids, when tracking
+ * is enabled, must also match so a new identity is always published.
+ */
+static bool
+publish_check(publish_policy& policy,
+              int64_t         timestamp,
+              const VAALBox*  boxes,
+              size_t          n_boxes,
+              const tracker*  tracks)
+{
+    if (!policy.changes) { return true; }
+
+    bool changed = policy.sent < 0 || n_boxes != policy.boxes.size() ||
+                   timestamp - policy.sent >= policy.keyframe;
+
+    policy.matched.assign(policy.boxes.size(), false);
+    for (size_t i = 0; !changed && i < n_boxes; i++) {
+        bool found = false;
+        for (size_t j = 0; !found && j < policy.boxes.size(); j++) {
+            const VAALBox& last = policy.boxes[j];
+            if (policy.matched[j] || last.label != boxes[i].label) { continue; }
+            if (tracks && policy.tracks[j] != tracks->ids[i]) { continue; }
+            if (fabsf(last.score - boxes[i].score) > policy.max_score) {
+                continue;
+            }
+            if (box_iou(last, boxes[i]) < policy.min_iou) { continue; }
+            policy.matched[j] = true;
+            found             = true;
+        }
+        changed = !found;
+    }
+
+    if (!changed) {
+        policy.suppressed++;
+        return false;
+    }
+
+    policy.sent = timestamp;
+    policy.boxes.assign(boxes, boxes + n_boxes);
+    policy.tracks.clear();
+    if (tracks) {
+        auto ids = tracks->ids.begin();
+        policy.tracks.assign(ids, ids + n_boxes);
+    }
+    return true;
+}
+
+/**
+ * The history keeps the results of the last window nanoseconds as compact
+ * records for the control channel's history queries.  Records are stored in a
+ * circular buffer ordered by timestamp, which grows while the oldest record is
+ * still inside the window and otherwise reuses the oldest record, including
+ * the capacity of its objects.
+ */
+struct history_record {
+    int64_t                         timestamp;
+    int64_t                         model_ns;
+    int                             fps;
+    std::vector<detect_ring_object> objects;
+};
+
+struct result_history {
+    int64_t                     window = 0;
+    size_t                      head   = 0;
+    size_t                      count  = 0;
+    std::vector<history_record> records;
+};
+
+static history_record&
+history_at(result_history& h, size_t index)
+{
+    return h.records[(h.head + index) % h.records.size()];
+}
+
+static const history_record&
+history_at(const result_history& h, size_t index)
+{
+    return h.records[(h.head + index) % h.records.size()];
+}
+
+/**
+ * Returns a record for a result of timestamp, dropping the records which fell
+ * out of the window.
+ */
+static history_record&
+history_next(result_history& h, int64_t timestamp)
+{
+    while (h.count && history_at(h, 0).timestamp < timestamp - h.window) {
+        h.head = (h.head + 1) % h.records.size();
+        h.count--;
+    }
+
+    if (h.count == h.records.size()) {
+        std::rotate(h.records.begin(),
+                    h.records.begin() + h.head,
+                    h.records.end());
+        h.records.resize(std::max<size_t>(64, h.records.size() * 2));
+        h.head = 0;
+    }
+
+    history_record& record = history_at(h, h.count++);
+    record.timestamp       = timestamp;
+    return record;
+}
+
+/**
+ * The index of the first record at timestamp or later, or of the first record
+ * later than timestamp when after is set.
+ */
+static size_t
+history_find(const result_history& h, int64_t timestamp, bool after)
+{
+    size_t first = 0, last = h.count;
+    while (first < last) {
+        size_t  mid    = (first + last) / 2;
+        int64_t record = history_at(h, mid).timestamp;
+        if (record < timestamp || (after && record == timestamp)) {
+            first = mid + 1;
+        } else {
+            last = mid;
+        }
+    }
+    return first;
+}
+
+/**
+ * The archive records the results into segment files under a directory for
+ * weeks of history on the device.  Results are gathered into blocks stored as
+ * columns of variable length integers: the timestamp deltas, object counts,
+ * model times, labels, tracks, the boxes and the scores quantized to 8 bits,
+ * then compressed with zlib.  The boxes are quantized to 16 bits and stored as
+ * the difference to the box in the same slot of the previous result of the
+ * block, objects which barely move between frames take a byte per value.  The
+ * tracks are only stored with the tracker and the classifier labels and scores
+ * with the classifier, which is recorded by its label count in the header.  A
+ * block is only written once it holds block_results results or every flush
+ * nanoseconds, which keeps the writes to the flash large and infrequent.
+ *
+ * Segments are named after the timestamp of their first result and start with
+ * the label tables, the index file next to each segment holds the timestamps
+ * and offset of every block so readers seek to the blocks of a time range.  A
+ * new segment is started once segment_size is reached and the oldest segments
+ * are removed to keep the archive under limit bytes.
+ */
+#define ARCHIVE_MAGIC 0x52414c44u
+#define ARCHIVE_BLOCK 0x42414c44u
+#define ARCHIVE_VERSION 2
+
+enum archive_column {
+    ARCHIVE_TIMES,
+    ARCHIVE_COUNTS,
+    ARCHIVE_TIMINGS,
+    ARCHIVE_LABELS,
+    ARCHIVE_TRACKS,
+    ARCHIVE_BOXES,
+    ARCHIVE_SCORES,
+    ARCHIVE_COLUMNS,
+};
+
+/**
+ * The segment header is followed by labels_size bytes holding the label_count
+ * labels then the class_count classifier labels, each NUL terminated.
+ */
+struct archive_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t label_count;
+    uint32_t class_count;
+    uint32_t labels_size;
+};
+
+/**
+ * The block header is followed by size bytes of the zlib compressed columns,
+ * columns holds the size of each column once uncompressed.
+ */
+struct archive_block {
+    uint32_t magic;
+    uint32_t results;
+    int64_t  first;
+    int64_t  last;
+    uint32_t size;
+    uint32_t columns[ARCHIVE_COLUMNS];
+};
+
+struct archive_index {
+    int64_t  first;
+    int64_t  last;
+    uint64_t offset;
+};
+
+struct result_archive {
+    const char* dir           = NULL;
+    int64_t     segment_size  = 16ll << 20;
+    int64_t     limit         = 1ll << 30;
+    int64_t     flush         = 60 * NSEC_PER_SEC;
+    size_t      block_results = 1024;
+
+    std::vector<std::string> labels;
+    std::vector<std::string> class_labels;
+
+    int     fd      = -1;
+    int     index   = -1;
+    int64_t written = 0;
+
+    // The block being gathered, boxes holds the quantized boxes of the
+    // previous result by slot.
+    size_t                              results = 0;
+    int64_t                             first   = 0;
+    int64_t                             last    = 0;
+    std::vector<uint8_t>                columns[ARCHIVE_COLUMNS];
+    std::vector<std::array<int32_t, 4>> boxes;
+    std::vector<uint8_t>                raw;
+    std::vector<uint8_t>                packed;
+};
+
+static void
+archive_varint(std::vector<uint8_t>& out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(uint8_t(value) | 0x80);
+        value >>= 7;
+    }
+    out.push_back(uint8_t(value));
+}
+
+static void
+archive_zigzag(std::vector<uint8_t>& out, int64_t value)
+{
+    archive_varint(out, (uint64_t(value) << 1) ^ uint64_t(value >> 63));
+}
+
+static int32_t
+archive_u16(float value)
+{
+    return int32_t(lrintf(std::min(std::max(value, 0.0f), 1.0f) * 65535.0f));
+}
+
+/**
+ * Stores the box as the difference of its quantized corner and size to the
+ * box previously stored in the slot.
+ */
+static void
+archive_box(std::vector<uint8_t>&         out,
+            std::array<int32_t, 4>&       slot,
+            const std::array<int32_t, 4>& box)
+{
+    for (int i = 0; i < 4; i++) {
+        archive_zigzag(out, box[i] - slot[i]);
+        slot[i] = box[i];
+    }
+}
+
+static void
+archive_u8(std::vector<uint8_t>& out, float value)
+{
+    out.push_back(
+        uint8_t(lrintf(std::min(std::max(value, 0.0f), 1.0f) * 255.0f)));
+}
+
+/**
+ * Reads a column while decoding a block, a column which runs out of data sets
+ * failed instead of reading past its end.
+ */
+struct archive_reader {
+    const uint8_t* data;
+    const uint8_t* end;
+    bool           failed;
+
+    uint64_t
+    varint()
+    {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (data == end) { break; }
+            uint8_t byte = *data++;
+            value |= uint64_t(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) { return value; }
+        }
+        failed = true;
+        return 0;
+    }
+
+    int64_t
+    zigzag()
+    {
+        uint64_t value = varint();
+        return int64_t(value >> 1) ^ -int64_t(value & 1);
+    }
+
+    /**
+     * Reads a box stored by archive_box into slot, returning its corner and
+     * size normalized.
+     */
+    std::array<float, 4>
+    box(std::array<int32_t, 4>& slot)
+    {
+        std::array<float, 4> box;
+        for (int i = 0; i < 4; i++) {
+            slot[i] += int32_t(zigzag());
+            box[i] = slot[i] / 65535.0f;
+        }
+        return box;
+    }
+
+    float
+    u8()
+    {
+        if (data == end) {
+            failed = true;
+            return 0.0f;
+        }
+        return *data++ / 255.0f;
+    }
+};
+
+/**
+ * Lists the segments of the archive directory sorted from the oldest, the
+ * zero padded names sort in the order of their timestamps.
+ */
+static int
+archive_segments(const char* dir, std::vector<std::string>& names)
+{
+    DIR* d = opendir(dir);
+    if (!d) { return -1; }
+
+    while (struct dirent* entry = readdir(d)) {
+        size_t len = strlen(entry->d_name);
+        if (len > 4 && !strcmp(entry->d_name + len - 4, ".dla")) {
+            names.push_back(std::string(entry->d_name, len - 4));
+        }
+    }
+
+    closedir(d);
+    std::sort(names.begin(), names.end());
+    return 0;
+}
+
+/**
+ * Removes the oldest segments until the archive fits its limit, the segment
+ * being written is always kept.
+ */
+static void
+archive_prune(result_archive& ar)
+{
+    std::vector<std::string> names;
+    std::vector<int64_t>     sizes;
+    int64_t                  total = 0;
+
+    if (archive_segments(ar.dir, names)) { return; }
+
+    for (auto& name : names) {
+        struct stat st;
+        int64_t     size = 0;
+        std::string path = std::string(ar.dir) + "/" + name;
+        if (!stat((path + ".dla").c_str(), &st)) { size += st.st_size; }
+        if (!stat((path + ".idx").c_str(), &st)) { size += st.st_size; }
+        sizes.push_back(size);
+        total += size;
+    }
+
+    for (size_t i = 0; i + 1 < names.size() && total > ar.limit; i++) {
+        std::string path = std::string(ar.dir) + "/" + names[i];
+        unlink((path + ".dla").c_str());
+        unlink((path + ".idx").c_str());
+        total -= sizes[i];
+        if (verbose) { printf("removed archive segment %s\n", path.c_str()); }
+    }
+}
+
+static void
+archive_close_segment(result_archive& ar)
+{
+    if (ar.fd >= 0) { close(ar.fd); }
+    if (ar.index >= 0) { close(ar.index); }
+    ar.fd    = -1;
+    ar.index = -1;
+}
+
+/**
+ * Starts a new segment named after timestamp and writes its label tables.
+ */
+static int
+archive_open_segment(result_archive& ar, int64_t timestamp)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%020lld", (long long) timestamp);
+    std::string path = std::string(ar.dir) + "/" + name;
+
+    archive_close_segment(ar);
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    ar.fd     = open((path + ".dla").c_str(), flags, 0644);
+    ar.index  = open((path + ".idx").c_str(), flags, 0644);
+    if (ar.fd < 0 || ar.index < 0) {
+        fprintf(stderr,
+                "failed to create archive segment %s: %s\n",
+                path.c_str(),
+                strerror(errno));
+        archive_close_segment(ar);
+        return -1;
+    }
+
+    std::string labels;
+    for (auto& label : ar.labels) { labels.append(label).push_back('\0'); }
+    for (auto& label : ar.class_labels) {
+        labels.append(label).push_back('\0');
+    }
+
+    archive_header header = {
+        .magic       = ARCHIVE_MAGIC,
+        .version     = ARCHIVE_VERSION,
+        .label_count = uint32_t(ar.labels.size()),
+        .class_count = uint32_t(ar.class_labels.size()),
+        .labels_size = uint32_t(labels.size()),
+    };
+
+    std::string data((const char*) &header, sizeof(header));
+    data += labels;
+    if (write(ar.fd, data.data(), data.size()) != ssize_t(data.size())) {
+        fprintf(stderr, "failed to write archive: %s\n", strerror(errno));
+        archive_close_segment(ar);
+        return -1;
+    }
+
+    ar.written = data.size();
+    archive_prune(ar);
+    return 0;
+}
+
+/**
+ * Compresses the block gathered so far and appends it to the segment, then
+ * appends its index entry.  A block which fails to be written is dropped, the
+ * next block starts a new segment.
+ */
+static int
+archive_flush(result_archive& ar)
+{
+    if (!ar.results) { return 0; }
+
+    archive_block block = {
+        .magic   = ARCHIVE_BLOCK,
+        .results = uint32_t(ar.results),
+        .first   = ar.first,
+        .last    = ar.last,
+        .size    = 0,
+        .columns = {},
+    };
+
+    ar.raw.clear();
+    ar.boxes.clear();
+    for (int i = 0; i < ARCHIVE_COLUMNS; i++) {
+        block.columns[i] = ar.columns[i].size();
+        ar.raw.insert(ar.raw.end(), ar.columns[i].begin(), ar.columns[i].end());
+        ar.columns[i].clear();
+    }
+    ar.results = 0;
+
+    uLongf size = compressBound(ar.raw.size());
+    ar.packed.resize(sizeof(block) + size);
+    int err = compress2(ar.packed.data() + sizeof(block),
+                        &size,
+                        ar.raw.data(),
+                        ar.raw.size(),
+                        Z_DEFAULT_COMPRESSION);
+    if (err != Z_OK) {
+        fprintf(stderr, "failed to compress archive block: %d\n", err);
+        return -1;
+    }
+
+    block.size = size;
+    memcpy(ar.packed.data(), &block, sizeof(block));
+    ar.packed.resize(sizeof(block) + size);
+
+    if (ar.fd < 0 || ar.written >= ar.segment_size) {
+        if (archive_open_segment(ar, block.first)) { return -1; }
+    }
+
+    archive_index entry = {
+        .first  = block.first,
+        .last   = block.last,
+        .offset = uint64_t(ar.written),
+    };
+
+    ssize_t len = ar.packed.size();
+    if (write(ar.fd, ar.packed.data(), len) != len ||
+        write(ar.index, &entry, sizeof(entry)) != sizeof(entry)) {
+        fprintf(stderr, "failed to write archive: %s\n", strerror(errno));
+        archive_close_segment(ar);
+        return -1;
+    }
+
+    ar.written += len;
+    return 0;
+}
+
+static void
+archive_close(result_archive& ar)
+{
+    archive_flush(ar);
+    archive_close_segment(ar);
+}
+
+/**
+ * Decodes the block of raw columns and calls fn with every result between
+ * from and to.  The labels are those of the segment header.
+ */
+static int
+archive_decode(const archive_block&               block,
+               const std::vector<uint8_t>&        raw,
+               const std::vector<std::string>&    labels,
+               const std::vector<std::string>&    class_labels,
+               int64_t                            from,
+               int64_t                            to,
+               std::function<int(json&)>&         fn)
+{
+    archive_reader columns[ARCHIVE_COLUMNS];
+    const uint8_t* data = raw.data();
+    for (int i = 0; i < ARCHIVE_COLUMNS; i++) {
+        columns[i] = {data, data + block.columns[i], false};
+        data += block.columns[i];
+    }
+
+    auto& times   = columns[ARCHIVE_TIMES];
+    auto& counts  = columns[ARCHIVE_COUNTS];
+    auto& timings = columns[ARCHIVE_TIMINGS];
+    auto& ids     = columns[ARCHIVE_LABELS];
+    auto& tracks  = columns[ARCHIVE_TRACKS];
+    auto& boxes   = columns[ARCHIVE_BOXES];
+    auto& scores  = columns[ARCHIVE_SCORES];
+
+    bool tracked  = block.columns[ARCHIVE_TRACKS] != 0;
+    bool classify = !class_labels.empty();
+
+    std::vector<std::array<int32_t, 4>> slots;
+
+    int64_t timestamp = block.first;
+    for (uint32_t r = 0; r < block.results; r++) {
+        data::result result = {};
+        timestamp += times.zigzag();
+        result.timestamp = timestamp;
+        result.model_ns  = int64_t(timings.varint()) * 1000;
+
+        json     payload = result;
+        json&    objects = payload["objects"];
+        uint64_t count   = counts.varint();
+        for (uint64_t i = 0; i < count && !boxes.failed; i++) {
+            if (slots.size() <= i) {
+                slots.push_back({});
+            }
+            int  label = int(ids.varint());
+            int  cls   = classify ? int(ids.varint()) - 1 : -1;
+            auto box   = boxes.box(slots[i]);
+
+            data::object obj = {
+                .label = label_text(labels, label),
+                .score = scores.u8(),
+                .bbox =
+                    {
+                        .xmin = box[0],
+                        .xmax = box[0] + box[2],
+                        .ymin = box[1],
+                        .ymax = box[1] + box[3],
+                    },
+            };
+
+            json object = obj;
+            if (tracked) { object["track"] = int(tracks.varint()); }
+            if (classify) {
+                object["class_label"] = label_text(class_labels, cls);
+                object["class_score"] = scores.u8();
+            }
+            objects.push_back(object);
+        }
+
+        for (auto& column : columns) {
+            if (column.failed) { return -1; }
+        }
+
+        if (timestamp < from || timestamp > to) { continue; }
+        int err = fn(payload);
+        if (err) { return err; }
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the segment at path from the first block which may hold results at or
+ * after from, stopping at the first block after to.  A truncated final block,
+ * as left by a power loss, ends the segment.  Returns 1 once past to.
+ */
+static int
+archive_read_segment(const std::string&                 path,
+                     int64_t                            from,
+                     int64_t                            to,
+                     std::function<int(json&)>&         fn)
+{
+    FILE* fp = fopen((path + ".dla").c_str(), "rb");
+    if (!fp) {
+        fprintf(stderr,
+                "failed to open %s.dla: %s\n",
+                path.c_str(),
+                strerror(errno));
+        return -1;
+    }
+
+    archive_header header;
+    std::string    table;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        header.magic != ARCHIVE_MAGIC || header.version != ARCHIVE_VERSION) {
+        fprintf(stderr, "invalid archive segment %s.dla\n", path.c_str());
+        fclose(fp);
+        return -1;
+    }
+
+    table.resize(header.labels_size);
+    if (fread(&table[0], 1, table.size(), fp) != table.size()) {
+        fclose(fp);
+        return -1;
+    }
+
+    std::vector<std::string> labels, class_labels;
+    for (size_t pos = 0; pos < table.size();) {
+        size_t end = table.find('\0', pos);
+        if (end == std::string::npos) { break; }
+        auto& list = labels.size() < header.label_count ? labels : class_labels;
+        list.push_back(table.substr(pos, end - pos));
+        pos = end + 1;
+    }
+
+    /**
+     * The index entries are ordered so the first block ending at or after from
+     * is found by a binary search, the blocks are then read in order.
+     */
+    std::vector<archive_index> entries;
+    if (FILE* idx = fopen((path + ".idx").c_str(), "rb")) {
+        archive_index entry;
+        while (fread(&entry, sizeof(entry), 1, idx) == 1) {
+            entries.push_back(entry);
+        }
+        fclose(idx);
+    }
+
+    auto it = std::lower_bound(entries.begin(),
+                               entries.end(),
+                               from,
+                               [](const archive_index& e, int64_t t) {
+                                   return e.last < t;
+                               });
+    if (it != entries.end()) { fseek(fp, it->offset, SEEK_SET); }
+
+    std::vector<uint8_t> packed, raw;
+    archive_block        block;
+    int                  err = 0;
+
+    while (!err && fread(&block, sizeof(block), 1, fp) == 1) {
+        if (block.magic != ARCHIVE_BLOCK) { break; }
+        if (block.first > to) {
+            err = 1;
+            break;
+        }
+
+        uLongf size = 0;
+        for (auto column : block.columns) { size += column; }
+
+        packed.resize(block.size);
+        raw.resize(size);
+        if (fread(packed.data(), 1, packed.size(), fp) != packed.size() ||
+            uncompress(raw.data(), &size, packed.data(), packed.size()) !=
+                Z_OK) {
+            break;
+        }
+        if (block.last < from) { continue; }
+
+        err = archive_decode(block, raw, labels, class_labels, from, to, fn);
+    }
+
+    fclose(fp);
+    return err;
+}
+
+/**
+ * Calls fn with every archived result between from and to in order, starting
+ * from the last segment which begins at or before from.
+ */
+static int
+archive_read(const char*                        dir,
+             int64_t                            from,
+             int64_t                            to,
+             std::function<int(json&)>         fn)
+{
+    std::vector<std::string> names;
+    if (archive_segments(dir, names)) {
+        fprintf(stderr,
+                "failed to open archive %s: %s\n",
+                dir,
+                strerror(errno));
+        return -1;
+    }
+
+    size_t start = 0;
+    while (start + 1 < names.size() &&
+           strtoll(names[start + 1].c_str(), NULL, 10) <= from) {
+        start++;
+    }
+
+    for (size_t i = start; i < names.size(); i++) {
+        std::string path = std::string(dir) + "/" + names[i];
+        int         err  = archive_read_segment(path, from, to, fn);
+        if (err) { return err > 0 ? 0 : err; }
+    }
+
+    return 0;
+}
+
+/**
+ * Writes the archived results between from and to as JSON lines, the reader
+ * side of the archive for --dump-archive.
+ */
+static int
+archive_dump(const char* dir, int64_t from, int64_t to, FILE* out)
+{
+    return archive_read(dir, from, to, [out](json& payload) {
+        auto line = payload.dump();
+        line.push_back('\n');
+        if (fwrite(line.data(), 1, line.size(), out) != line.size()) {
+            fprintf(stderr, "failed to write results: %s\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    });
+}
+
+/**
+ * The stream configuration tells subscribers the source and the frame geometry
+ * the normalized boxes refer to.  It is published ahead of the first result,
+ * whenever the geometry of the frames changes and, once changed is set by the
+ * videostream capture, after a reconnection.  The fps is that of the source
+ * when known, otherwise 0.
+ */
+struct stream_info {
+    std::string topic   = "STREAM";
+    std::string source;
+    float       fps     = 0.0f;
+    bool        changed = true;
+    uint32_t    fourcc  = 0;
+    int         width   = 0;
+    int         height  = 0;
+};
+
+/**
+ * The pipeline groups the model and the optional stages which process_frame
+ * applies to every frame, stages which are not enabled are left NULL.
+ */
+struct pipeline {
+    VAALContext*         vaal     = NULL;
+    std::string          model;
+    native::decoder*     native   = NULL;
+    gatekeeper*          gate     = NULL;
+    ensemble*            fusion   = NULL;
+    cascade*             classify = NULL;
+    const class_filter*  filter   = NULL;
+    zone_set*            zones    = NULL;
+    tracker*             tracks   = NULL;
+    line_set*            lines    = NULL;
+    result_ring*         ring     = NULL;
+    result_history*      history  = NULL;
+    result_archive*      archive  = NULL;
+    frame_cache*         held     = NULL;
+    snapshot_pool*       snapshot = NULL;
+    publish_policy*      policy   = NULL;
+    stream_info*         stream   = NULL;
+    FILE*                output   = NULL;
+    std::vector<VAALBox> boxes;
+
+    // Labels of the model and classifier interned when the model is loaded,
+    // with label_ids the results only hold their indices.
+    std::vector<std::string> labels;
+    std::vector<std::string> class_labels;
+    bool                     label_ids = false;
+
+    // Settings changed at runtime by the control channel, with swap set when
+    // the model can also be replaced.
+    float threshold = 0.5f;
+    float iou       = 0.5f;
+    int   skip      = 0;
+    bool  swap      = false;
+
+    // Statistics reported by the control channel.
+    int64_t frames  = 0;
+    int64_t skipped = 0;
+    int     fps     = 0;
+
+    // Time from startup to the first result, the startup benchmark stops the
+    // application once known.
+    int64_t started    = 0;
+    int64_t first_ns   = 0;
+    bool    exit_first = false;
+};
+
+/**
+ * Runs the full model, and the ensemble when enabled, on the frame storing the
+ * boxes into pipe.boxes and the timings into result.
+ */
+static int
+run_detector(pipeline&     pipe,
+             input_frame&  frame,
+             data::result& result,
+             size_t&       n_boxes)
+{
+    int     err;
+    int64_t start;
+
+    VAALContext*          vaal   = pipe.vaal;
+    native::decoder*      native = pipe.native;
+    std::vector<VAALBox>& boxes  = pipe.boxes;
+
+    start = vaal_clock_now();
+    err   = load_frame(vaal, frame, NULL);
+    if (err) {
+        fprintf(stderr,
+                "failed to load frame into model: %s\n",
+                vaal_strerror(VAALError(err)));
+        return -1;
+    }
+
+    /**
+     * The frame is released as soon as it is loaded into the model unless
+     * later stages, such as the ensemble or the cascade classifier, need to
+     * load it again in which case the frame is held until they complete.  The
+     * frame cache and the snapshot pool keep the frame after processing.
+     */
+    if (!pipe.fusion && !pipe.classify && !pipe.held && !pipe.snapshot) {
+        frame.release();
+    }
+
+    result.load_ns = vaal_clock_now() - start;
+
+    start = vaal_clock_now();
+    err   = vaal_run_model(vaal);
+    if (err) {
+        fprintf(stderr,
+                "failed to run model: %s\n",
+                vaal_strerror(VAALError(err)));
+        return -1;
+    }
+    result.model_ns = vaal_clock_now() - start;
+
+    /**
+     * The vaal_boxes function will load our array of VAALBox structures with
+     * the bounding boxes identified by the model output.  The max_boxes
+     * parameter is the size of the boxes array while the n_boxes is updated by
+     * vaal_boxes with the actual number of bounding boxes loaded into the boxes
+     * array, in other words the number of box detections from this inference.
+     *
+     * The vaal_boxes function internally handles the model output box decoding
+     * and nms.  When a native decoder is provided it replaces vaal_boxes and
+     * additionally reports the decode and nms timings.
+     */
+    start = vaal_clock_now();
+    if (native && native->enabled) {
+        err = native::boxes(*native, boxes.data(), boxes.size(), &n_boxes);
+    } else {
+        err = vaal_boxes(vaal, boxes.data(), boxes.size(), &n_boxes);
+    }
+    if (err) {
+        fprintf(stderr,
+                "failed to read bounding boxes from model: %s\n",
+                vaal_strerror(VAALError(err)));
+        return -1;
+    }
+    result.boxes_ns = vaal_clock_now() - start;
+
+    if (native && native->enabled) {
+        result.decode_ns = native->decode_ns;
+        result.nms_ns    = native->nms_ns;
+    }
+
+    if (native && benchmark_nms) {
+        native::compare(vaal, *native, boxes.size(), result.boxes_ns, n_boxes);
+    }
+
+    /**
+     * The ensemble members run on the frame still held from the primary model
+     * then all the predictions are merged by weighted box fusion.
+     */
+    if (pipe.fusion) {
+        ensemble& ens = *pipe.fusion;
+
+        start = vaal_clock_now();
+        err   = ensemble_run(ens, vaal, boxes.data(), n_boxes, frame);
+        if (err) { return -1; }
+        result.ensemble_ns = vaal_clock_now() - start;
+
+        start            = vaal_clock_now();
+        n_boxes          = ensemble_fuse(ens,
+                                         boxes.data(),
+                                         boxes.size(),
+                                         pipe.threshold);
+        result.fusion_ns = vaal_clock_now() - start;
+    }
+
+    return 0;
+}
+
+/**
+ * Converts the first n_boxes of pipe.boxes into the result objects and returns
+ * the result payload.  With label_ids the objects hold label indices in place
+ * of the label text.  The fields of the optional stages, such as the track
+ * identities and the classifier labels, are only added when enabled.
+ */
+static json
+result_payload(const pipeline& pipe, data::result& result, size_t n_boxes)
+{
+    const tracker* tracks = pipe.tracks;
+
+    std::vector<data::object_id> ids;
+    if (pipe.label_ids) { ids.reserve(n_boxes); }
+
+    for (size_t i = 0; i < n_boxes; i++) {
+        const VAALBox* box   = &pipe.boxes[i];
+        int            cls   = -1;
+        float          score = 0.0f;
+
+        if (pipe.classify && pipe.classify->labels[i] >= 0) {
+            cls   = pipe.classify->labels[i];
+            score = pipe.classify->scores[i];
+        }
+
+        data::box bbox = {
+            .xmin = box->xmin,
+            .xmax = box->xmax,
+            .ymin = box->ymin,
+            .ymax = box->ymax,
+        };
+
+        if (pipe.label_ids) {
+            ids.push_back({
+                .label       = box->label,
+                .score       = box->score,
+                .bbox        = bbox,
+                .track       = tracks ? tracks->ids[i] : 0,
+                .class_label = cls,
+                .class_score = score,
+            });
+            continue;
+        }
+
+        result.objects.push_back({
+            .label       = label_text(pipe.labels, box->label),
+            .score       = box->score,
+            .bbox        = bbox,
+            .track       = tracks ? tracks->ids[i] : 0,
+            .class_label = label_text(pipe.class_labels, cls),
+            .class_score = score,
+        });
+    }
+
+    json payload = result;
+    if (pipe.held || pipe.snapshot) { payload["serial"] = result.serial; }
+    if (pipe.gate || pipe.swap) { payload["model"] = result.model; }
+    if (pipe.gate) { payload["gate_ns"] = result.gate_ns; }
+
+    if (pipe.native && pipe.native->enabled) {
+        payload["decode_ns"] = result.decode_ns;
+        payload["nms_ns"]    = result.nms_ns;
+    }
+
+    if (pipe.fusion) {
+        payload["ensemble_ns"] = result.ensemble_ns;
+        payload["fusion_ns"]   = result.fusion_ns;
+    }
+
+    if (pipe.classify) { payload["classify_ns"] = result.classify_ns; }
+
+    if (pipe.label_ids) { payload["objects"] = ids; }
+
+    for (size_t i = 0; i < n_boxes; i++) {
+        json& object = payload["objects"][i];
+        if (tracks) { object["track"] = tracks->ids[i]; }
+        if (!pipe.classify) { continue; }
+        if (pipe.label_ids) {
+            object["class_label"] = ids[i].class_label;
+            object["class_score"] = ids[i].class_score;
+        } else {
+            object["class_label"] = result.objects[i].class_label;
+            object["class_score"] = result.objects[i].class_score;
+        }
+    }
+
+    return payload;
+}
+
+/**
+ * The label table lets subscribers of --label-ids results map the indices back
+ * to the labels, it is published once the publisher is ready, after a model
+ * swap and on request of the control channel.
+ */
+static data::label_table
+label_table(const pipeline& pipe)
+{
+    data::label_table table = {
+        .timestamp    = vaal_clock_now(),
+        .model        = pipe.model,
+        .labels       = pipe.labels,
+        .class_labels = pipe.class_labels,
+    };
+    return table;
+}
+
+/**
+ * Publishes the label table ahead of the results which use it, the table is
+ * queued along with them so a result never arrives in place of its table.
+ */
+static void
+label_publish(zmq::socket_t&      pub,
+              const std::string& topic,
+              const pipeline&    pipe)
+{
+    if (topic.empty()) { return; }
+
+    json payload = label_table(pipe);
+    publish(pub, topic, payload.dump());
+}
+
+/**
+ * Publishes the stream configuration when the frame geometry differs from the
+ * one last published, or when the source reconnected.
+ */
+static void
+stream_publish(zmq::socket_t& pub, stream_info& stream, const input_frame& frame)
+{
+    if (!stream.changed && frame.fourcc == stream.fourcc &&
+        frame.width == stream.width && frame.height == stream.height) {
+        return;
+    }
+
+    stream.changed = false;
+    stream.fourcc  = frame.fourcc;
+    stream.width   = frame.width;
+    stream.height  = frame.height;
+    if (stream.topic.empty()) { return; }
+
+    char fourcc[5] = {char(frame.fourcc & 0xff),
+                      char((frame.fourcc >> 8) & 0xff),
+                      char((frame.fourcc >> 16) & 0xff),
+                      char((frame.fourcc >> 24) & 0xff),
+                      0};
+
+    json payload = data::stream{
+        .timestamp = vaal_clock_now(),
+        .source    = stream.source,
+        .fourcc    = fourcc,
+        .width     = frame.width,
+        .height    = frame.height,
+        .fps       = stream.fps,
+    };
+    publish(pub, stream.topic, payload.dump());
+}
+
+static void
+ring_object(const pipeline& pipe, size_t i, detect_ring_object& obj)
+{
+    const VAALBox& box = pipe.boxes[i];
+
+    obj.xmin        = box.xmin;
+    obj.ymin        = box.ymin;
+    obj.xmax        = box.xmax;
+    obj.ymax        = box.ymax;
+    obj.score       = box.score;
+    obj.label       = box.label;
+    obj.track       = pipe.tracks ? pipe.tracks->ids[i] : 0;
+    obj.class_label = pipe.classify ? pipe.classify->labels[i] : -1;
+    obj.class_score = pipe.classify ? pipe.classify->scores[i] : 0.0f;
+}
+
+/**
+ * Writes the result into the next record of the ring, the record's sequence is
+ * odd while written so readers retry instead of reading a torn record, then
+ * readers waiting on the futex are woken.  The wake is skipped while no reader
+ * waits, which keeps the syscall off the frame path.
+ */
+static void
+ring_write(result_ring&        ring,
+           const pipeline&     pipe,
+           const data::result& result,
+           size_t              n_boxes)
+{
+    detect_ring_header* header = ring.header;
+    uint64_t            index  = header->head;
+    detect_ring_record* record = &ring.records[index % ring.capacity];
+    uint32_t            seq    = record->seq;
+
+    __atomic_store_n(&record->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    size_t count      = std::min<size_t>(n_boxes, DETECT_RING_MAX_OBJECTS);
+    record->count     = count;
+    record->index     = index;
+    record->timestamp = result.timestamp;
+    record->model_ns  = result.model_ns;
+    record->total     = n_boxes;
+    record->fps       = result.fps;
+
+    for (size_t i = 0; i < count; i++) {
+        ring_object(pipe, i, record->objects[i]);
+    }
+
+    __atomic_store_n(&record->seq, seq + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->head, index + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&header->wake, uint32_t(index + 1), __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&header->waiters, __ATOMIC_SEQ_CST)) {
+        syscall(SYS_futex, &header->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+/**
+ * Stores the result into the history, the objects use the same compact layout
+ * as the shared memory ring.
+ */
+static void
+history_add(result_history&     h,
+            const pipeline&     pipe,
+            const data::result& result,
+            size_t              n_boxes)
+{
+    history_record& record = history_next(h, result.timestamp);
+    record.model_ns        = result.model_ns;
+    record.fps             = result.fps;
+    record.objects.resize(n_boxes);
+
+    for (size_t i = 0; i < n_boxes; i++) {
+        ring_object(pipe, i, record.objects[i]);
+    }
+}
+
+/**
+ * Appends the result to the columns of the archive block, which is written
+ * once full.  The timestamps are stored as deltas from the previous result and
+ * the boxes by their corner and size as deltas from the same slot of the
+ * previous result.
+ */
+static void
+archive_add(result_archive&     ar,
+            const pipeline&     pipe,
+            const data::result& result,
+            size_t              n_boxes)
+{
+    auto& columns = ar.columns;
+
+    if (!ar.results) { ar.first = ar.last = result.timestamp; }
+    archive_zigzag(columns[ARCHIVE_TIMES], result.timestamp - ar.last);
+    archive_varint(columns[ARCHIVE_COUNTS], n_boxes);
+    archive_varint(columns[ARCHIVE_TIMINGS],
+                   std::max<int64_t>(result.model_ns, 0) / 1000);
+    ar.last = result.timestamp;
+
+    for (size_t i = 0; i < n_boxes; i++) {
+        detect_ring_object obj;
+        ring_object(pipe, i, obj);
+
+        archive_varint(columns[ARCHIVE_LABELS], std::max(obj.label, 0));
+        if (ar.boxes.size() <= i) {
+            ar.boxes.push_back({});
+        }
+        archive_box(columns[ARCHIVE_BOXES],
+                    ar.boxes[i],
+                    {
+                        archive_u16(obj.xmin),
+                        archive_u16(obj.ymin),
+                        archive_u16(obj.xmax - obj.xmin),
+                        archive_u16(obj.ymax - obj.ymin),
+                    });
+        archive_u8(columns[ARCHIVE_SCORES], obj.score);
+
+        if (pipe.tracks) { archive_varint(columns[ARCHIVE_TRACKS], obj.track); }
+        if (!ar.class_labels.empty()) {
+            archive_varint(columns[ARCHIVE_LABELS], obj.class_label + 1);
+            archive_u8(columns[ARCHIVE_SCORES], obj.class_score);
+        }
+    }
+
+    if (++ar.results >= ar.block_results) { archive_flush(ar); }
+}
+
+/**
+ * Answers a history query of the control channel with the results between the
+ * from and to timestamps, optionally only those with an object of label, and
+ * at most limit of the most recent results.
+ */
+static json
+history_query(const result_history& h, const pipeline& pipe, const json& req)
+{
+    int64_t     from  = req.value("from", int64_t(0));
+    int64_t     to    = req.value("to", std::numeric_limits<int64_t>::max());
+    size_t      limit = req.value("limit", h.count);
+    std::string label = req.value("label", "");
+
+    int detect = -1, classify = -1;
+    if (!label.empty()) {
+        auto find = [&label](const std::vector<std::string>& labels) {
+            auto it = std::find(labels.begin(), labels.end(), label);
+            return it == labels.end() ? -2 : int(it - labels.begin());
+        };
+        detect   = find(pipe.labels);
+        classify = find(pipe.class_labels);
+    }
+
+    std::vector<size_t> matches;
+    size_t              first = history_find(h, from, false);
+    size_t              last  = std::max(first, history_find(h, to, true));
+
+    for (size_t i = last; i > first && matches.size() < limit; i--) {
+        const history_record& record = history_at(h, i - 1);
+        bool                  found  = label.empty();
+        for (size_t j = 0; !found && j < record.objects.size(); j++) {
+            found = record.objects[j].label == detect ||
+                    record.objects[j].class_label == classify;
+        }
+        if (found) { matches.push_back(i - 1); }
+    }
+
+    json results = json::array();
+    for (auto it = matches.rbegin(); it != matches.rend(); it++) {
+        const history_record& record = history_at(h, *it);
+
+        json objects = json::array();
+        for (auto& obj : record.objects) {
+            json object = {
+                {"bbox",
+                 data::box{
+                     .xmin = obj.xmin,
+                     .xmax = obj.xmax,
+                     .ymin = obj.ymin,
+                     .ymax = obj.ymax,
+                 }},
+                {"score", obj.score},
+            };
+            if (pipe.label_ids) {
+                object["label"] = obj.label;
+            } else {
+                object["label"] = label_text(pipe.labels, obj.label);
+            }
+            if (pipe.tracks) { object["track"] = obj.track; }
+            if (pipe.classify) {
+                if (pipe.label_ids) {
+                    object["class_label"] = obj.class_label;
+                } else {
+                    object["class_label"] = label_text(pipe.class_labels,
+                                                       obj.class_label);
+                }
+                object["class_score"] = obj.class_score;
+            }
+            objects.push_back(object);
+        }
+
+        results.push_back({
+            {"timestamp", record.timestamp},
+            {"fps", record.fps},
+            {"model_ns", record.model_ns},
+            {"objects", objects},
+        });
+    }
+
+    return results;
+}
+
+/**
+ * Publishes the result payload, or writes it to output when set.  Results
+ * written to the output file are stored one per line (JSON Lines) instead of
+ * being published.
+ */
+static int
+result_send(zmq::socket_t&     pub,
+            const std::string& topic,
+            FILE*              output,
+            const json&        payload)
+{
+    if (output) {
+        auto line = payload.dump();
+        if (verbose) { std::cout << line << std::endl; }
+        line.push_back('\n');
+        if (fwrite(line.data(), 1, line.size(), output) != line.size()) {
+            fprintf(stderr, "failed to write results: %s\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    publish(pub, topic, payload.dump(4));
+    return 0;
+}
+
+/**
+ * This function is where we perform model inferencing with VisionPack VAAL on
+ * a frame and publish the results.  The frame is always released on return.
+ */
+static int
+process_frame(zmq::socket_t&     pub,
+              const std::string& topic,
+              const std::string& capture,
+              pipeline&          pipe,
+              input_frame&       frame)
+{
+    int err;
+
+    tracker*              tracks = pipe.tracks;
+    std::vector<VAALBox>& boxes  = pipe.boxes;
+
+    /**
+     * With a frame skip only one of every skip + 1 frames is processed.
+     */
+    int64_t count = pipe.frames++;
+    if (pipe.skip && count % (pipe.skip + 1)) {
+        pipe.skipped++;
+        frame.release();
+        return 0;
+    }
+
+    auto fps       = update_fps();
+    auto timestamp = frame.timestamp;
+    pipe.fps       = fps;
+
+    if (pipe.stream) { stream_publish(pub, *pipe.stream, frame); }
+
+    /**
+     * If capture is set then we need to publish a capture event with timestamp
+     * and frame serial so that other services, such as image logging, can be
+     * synchronized with the model frame capture.
+     */
+    if (capture.size()) {
+        json payload = data::capture{
+            .timestamp = timestamp,
+            .serial    = frame.serial,
+        };
+        publish(pub, capture, payload.dump(4));
+    }
+
+    /**
+     * The following code generates a JSON structure with the inference results.
+     * The model and timing information is populated into fields of the root
+     * object as each stage completes then an array of detected boxes is
+     * populated.
+     */
+    data::result result = {
+        .timestamp = timestamp,
+        .serial    = frame.serial,
+        .fps       = fps,
+        .model     = pipe.model,
+    };
+
+    /**
+     * When the gate is closed the full model is skipped entirely and the gate
+     * model's boxes are reported instead.
+     */
+    int    detect  = 1;
+    size_t n_boxes = 0;
+
+    if (pipe.gate) {
+        detect = gate_run(*pipe.gate, frame);
+        if (detect < 0) {
+            frame.release();
+            return -1;
+        }
+        result.gate_ns = pipe.gate->gate_ns;
+    }
+
+    if (detect) {
+        err = run_detector(pipe, frame, result, n_boxes);
+        if (err) {
+            frame.release();
+            return -1;
+        }
+    } else {
+        n_boxes      = gate_boxes(*pipe.gate, boxes.data(), boxes.size());
+        result.model = pipe.gate->name;
+    }
+
+    /**
+     * The per-class thresholds and allow/deny lists are applied before the
+     * boxes are converted into result objects so filtered boxes never cost any
+     * label lookups or serialization.
+     */
+    if (pipe.filter) {
+        n_boxes = filter_apply(*pipe.filter, boxes.data(), n_boxes);
+    }
+
+    /**
+     * The cascade classifies crops of the final boxes from the held frame
+     * which is then released.
+     */
+    if (pipe.classify) {
+        err = cascade_run(*pipe.classify, boxes.data(), n_boxes, frame);
+        if (err) {
+            frame.release();
+            return -1;
+        }
+        result.classify_ns = pipe.classify->classify_ns;
+    }
+
+    if (tracks) { tracker_update(*tracks, boxes.data(), n_boxes); }
+
+    int zone_events = 0;
+    if (pipe.zones) {
+        zone_events = zone_update(*pipe.zones,
+                                  pub,
+                                  timestamp,
+                                  boxes.data(),
+                                  n_boxes,
+                                  tracks ? tracks->ids.data() : NULL);
+    }
+
+    /**
+     * A frame handed over to the snapshot workers is released by them once
+     * encoded, which leaves nothing to release here, so it is not also kept in
+     * the frame cache.
+     */
+    bool taken = pipe.snapshot && snapshot_trigger(*pipe.snapshot,
+                                                   frame,
+                                                   pipe.labels,
+                                                   boxes.data(),
+                                                   n_boxes,
+                                                   zone_events);
+    if (!taken && pipe.held) {
+        frame_hold(*pipe.held, frame);
+    } else {
+        frame.release();
+    }
+
+    if (pipe.lines) { line_update(*pipe.lines, pub, timestamp, *tracks); }
+
+    if (!pipe.first_ns) {
+        pipe.first_ns = vaal_clock_now() - pipe.started;
+        if (verbose || pipe.exit_first) {
+            printf("time to first result %.1fms\n", pipe.first_ns / 1e6);
+        }
+        if (pipe.exit_first) { running = 0; }
+    }
+
+    if (pipe.ring) { ring_write(*pipe.ring, pipe, result, n_boxes); }
+    if (pipe.history) { history_add(*pipe.history, pipe, result, n_boxes); }
+    if (pipe.archive) { archive_add(*pipe.archive, pipe, result, n_boxes); }
+
+    /**
+     * An empty topic disables the detection results, for example when only
+     * the zone events are of interest.
+     */
+    if (topic.empty()) { return 0; }
+
+    /**
+     * With the changes policy results repeating the last one sent are dropped
+     * before they cost any serialization.
+     */
+    if (pipe.policy) {
+        auto& policy = *pipe.policy;
+        if (!publish_check(policy, timestamp, boxes.data(), n_boxes, tracks)) {
+            return 0;
+        }
+    }
+
+    json payload = result_payload(pipe, result, n_boxes);
+    return result_send(pub, topic, pipe.output, payload);
+}
+
+/**
+ * The reactor waits on every event source of the application, such as frames,
+ * signals and timers, with a single epoll instance and calls the handler of
+ * each ready file descriptor.  Nothing is polled on a timeout so frames are
+ * processed and shutdown happens as soon as the event occurs.  A handler
+ * returning non-zero stops the reactor with an error.
+ */
+typedef std::function<int(uint32_t events)> reactor_handler;
+
+struct reactor {
+    int                            epfd = -1;
+    std::map<int, reactor_handler> handlers;
+    std::vector<int>               owned;
+};
+
+static int
+reactor_init(reactor& r)
+{
+    r.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (r.epfd < 0) {
+        fprintf(stderr, "failed to create epoll: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int
+reactor_add(reactor& r, int fd, uint32_t events, reactor_handler handler)
+{
+    struct epoll_event ev = {};
+    ev.events             = events;
+    ev.data.fd            = fd;
+    if (epoll_ctl(r.epfd, EPOLL_CTL_ADD, fd, &ev)) {
+        fprintf(stderr, "failed to add %d to epoll: %s\n", fd, strerror(errno));
+        return -1;
+    }
+    r.handlers[fd] = std::move(handler);
+    return 0;
+}
+
+/**
+ * Creates an eventfd owned by the reactor which calls handler once written,
+ * used to wake the reactor from other threads.  Returns the eventfd.
+ */
+static int
+reactor_event(reactor& r, std::function<int()> handler)
+{
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+    r.owned.push_back(fd);
+
+    int err = reactor_add(r, fd, EPOLLIN, [fd, handler](uint32_t) {
+        uint64_t count;
+        if (read(fd, &count, sizeof(count)) != sizeof(count)) { return 0; }
+        return handler();
+    });
+    return err ? -1 : fd;
+}
+
+static void
+reactor_notify(int fd)
+{
+    uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) != sizeof(one)) {
+        fprintf(stderr, "failed to notify eventfd: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * Calls handler every interval nanoseconds using a timerfd.
+ */
+static int
+reactor_timer(reactor& r, int64_t interval, std::function<int()> handler)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create timerfd: %s\n", strerror(errno));
+        return -1;
+    }
+    r.owned.push_back(fd);
+
+    struct itimerspec spec = {};
+    spec.it_interval.tv_sec  = interval / NSEC_PER_SEC;
+    spec.it_interval.tv_nsec = interval % NSEC_PER_SEC;
+    spec.it_value            = spec.it_interval;
+    if (timerfd_settime(fd, 0, &spec, NULL)) {
+        fprintf(stderr, "failed to set timerfd: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return reactor_add(r, fd, EPOLLIN, [fd, handler](uint32_t) {
+        uint64_t expirations;
+        if (read(fd, &expirations, sizeof(expirations)) < 0) { return 0; }
+        return handler();
+    });
+}
+
+/**
+ * Delivers SIGINT and SIGTERM through a signalfd to the quit handler.  The
+ * signals are blocked for the calling thread and every thread it creates
+ * afterwards so this must be called before starting any thread.
+ */
+static int
+reactor_signals(reactor& r, void (*handler)(int))
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "failed to create signalfd: %s\n", strerror(errno));
+        return -1;
+    }
+    r.owned.push_back(fd);
+
+    return reactor_add(r, fd, EPOLLIN, [fd, handler](uint32_t) {
+        struct signalfd_siginfo info;
+        while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+            handler(int(info.ssi_signo));
+        }
+        return 0;
+    });
+}
+
+static int
+reactor_run(reactor& r)
+{
+    struct epoll_event events[16];
+
+    while (running) {
+        int n = epoll_wait(r.epfd, events, 16, -1);
+        if (n < 0 && errno == EINTR) { continue; }
+        if (n < 0) {
+            fprintf(stderr, "failed to wait on epoll: %s\n", strerror(errno));
+            return -1;
+        }
+
+        for (int i = 0; i < n && running; i++) {
+            auto handler = r.handlers.find(events[i].data.fd);
+            if (handler == r.handlers.end()) { continue; }
+            if (handler->second(events[i].events)) { return -1; }
+        }
+    }
+
+    return 0;
+}
+
+static void
+reactor_close(reactor& r)
+{
+    for (int fd : r.owned) { close(fd); }
+    r.owned.clear();
+    r.handlers.clear();
+    if (r.epfd >= 0) { close(r.epfd); }
+    r.epfd = -1;
+}
+
+/**
+ * Adds a ZeroMQ socket to the reactor through its ZMQ_FD.  The descriptor
+ * only signals that the socket state changed so the handler is called for as
+ * long as the socket has messages waiting.
+ */
+static int
+reactor_add_zmq(reactor& r, zmq::socket_t& socket, std::function<int()> handler)
+{
+    int fd = socket.get(zmq::sockopt::fd);
+    return reactor_add(r, fd, EPOLLIN, [&socket, handler](uint32_t) {
+        while (socket.get(zmq::sockopt::events) & ZMQ_POLLIN) {
+            int err = handler();
+            if (err) { return err; }
+        }
+        return 0;
+    });
+}
+
+/**
+ * With --last-value the last messages are served on a REP socket of their own
+ * so only the subscriber which asks receives them.  The request is a topic
+ * prefix, as given to the SUB socket, and the reply holds the last message of
+ * every topic it matches, one per part, or a single empty part when none does.
+ */
+static int
+last_value_handle(zmq::socket_t& socket)
+{
+    zmq::message_t request;
+    if (!socket.recv(request, zmq::recv_flags::dontwait)) { return 0; }
+
+    std::string              prefix = request.to_string();
+    std::vector<std::string> values;
+    for (auto& value : last_values) {
+        if (value.second.compare(0, prefix.size(), prefix)) { continue; }
+        values.push_back(value.second);
+    }
+    if (values.empty()) { values.emplace_back(); }
+
+    auto more = zmq::send_flags::sndmore | zmq::send_flags::dontwait;
+    for (size_t i = 0; i < values.size(); i++) {
+        socket.send(zmq::buffer(values[i]),
+                    i + 1 < values.size() ? more : zmq::send_flags::dontwait);
+    }
+
+    return 0;
+}
+
+/**
+ * Sets the thresholds and maximum detections on the model and every stage
+ * which runs its own copy of them, including the gate model.
+ */
+static void
+control_apply(pipeline& pipe, int max_boxes)
+{
+    std::vector<VAALContext*> contexts = {pipe.vaal};
+    if (pipe.fusion) {
+        for (auto& member : pipe.fusion->members) {
+            if (member.vaal) { contexts.push_back(member.vaal); }
+        }
+    }
+
+    for (auto vaal : contexts) {
+        vaal_parameter_setf(vaal, "score_threshold", &pipe.threshold, 1);
+        vaal_parameter_setf(vaal, "iou_threshold", &pipe.iou, 1);
+        vaal_parameter_seti(vaal, "max_detection", &max_boxes, 1);
+    }
+
+    if (pipe.native) {
+        pipe.native->score_threshold = pipe.threshold;
+        pipe.native->iou_threshold   = pipe.iou;
+    }
+
+    /**
+     * The gate model keeps running at the lower of the gate and detection
+     * thresholds so its boxes can still stand in for the results.
+     */
+    if (pipe.gate) {
+        gatekeeper& g         = *pipe.gate;
+        float       threshold = std::min(g.low, pipe.threshold);
+        vaal_parameter_setf(g.vaal, "score_threshold", &threshold, 1);
+        vaal_parameter_setf(g.vaal, "iou_threshold", &pipe.iou, 1);
+        vaal_parameter_seti(g.vaal, "max_detection", &max_boxes, 1);
+        g.min_score = pipe.threshold;
+        g.boxes.resize(max_boxes);
+    }
+
+    if (pipe.fusion) { pipe.fusion->scratch.resize(max_boxes); }
+    pipe.boxes.resize(max_boxes);
+}
+
+/**
+ * The model swap loads a new model into a second VAALContext on a background
+ * thread while the current context keeps processing frames.  Once loaded and
+ * warmed up the reactor switches the pipeline to the new context between two
+ * frames and releases the old one, so replacing the model causes no gap in the
+ * results.  A swap is requested by the control channel or, with --watch, when
+ * the model file is replaced.  A request made while loading is queued and the
+ * latest request wins.
+ *
+ * The filter, zones, tracker, lines, classifier, gate, label ids, result ring,
+ * history and archive refer to the model's labels by index so with any of them
+ * enabled the new model must have the same labels.  The ring and the archive
+ * write the label table once, and the tracks and label ids would carry the
+ * indices of the previous table across the swap.
+ */
+struct model_swap {
+    const char*     engine  = NULL;
+    std::string     path;
+    std::string     pending;
+    int             event   = -1;
+    int             inotify = -1;
+    bool            loading = false;
+    std::thread     thread;
+    native::decoder decoder;
+
+    // Called after the new model replaced the current one.
+    std::function<void()> swapped;
+
+    // Written by the loading thread, read by the reactor after joining it.
+    VAALContext* vaal    = NULL;
+    std::string  loading_path;
+    std::string  error;
+    int64_t      load_ns = 0;
+};
+
+static void
+swap_load(model_swap& sw, bool native, int max_boxes)
+{
+    int64_t      start = vaal_clock_now();
+    const char*  path  = sw.loading_path.c_str();
+    VAALContext* vaal  = vaal_context_create(sw.engine);
+    if (!vaal) {
+        sw.error = "failed to create vaal context";
+        reactor_notify(sw.event);
+        return;
+    }
+
+    int err = vaal_load_model_file(vaal, path);
+    if (err) {
+        sw.error = std::string("failed to load model: ") +
+                   vaal_strerror(VAALError(err));
+        vaal_context_release(vaal);
+        reactor_notify(sw.event);
+        return;
+    }
+
+    vaal_parameter_sets(vaal, "nms_type", "standard", 0);
+    vaal_parameter_seti(vaal, "max_detection", &max_boxes, 1);
+
+    if (native && native::decoder_init(sw.decoder, vaal)) {
+        sw.error = "unsupported model outputs for native decoding";
+        vaal_context_release(vaal);
+        reactor_notify(sw.event);
+        return;
+    }
+
+    /**
+     * The first inferences are much slower as the engine finishes preparing
+     * the graph, they are run here rather than on the first live frame.
+     */
+    for (int i = 0; i < 2; i++) {
+        err = vaal_run_model(vaal);
+        if (err) {
+            sw.error = std::string("failed to run model: ") +
+                       vaal_strerror(VAALError(err));
+            vaal_context_release(vaal);
+            reactor_notify(sw.event);
+            return;
+        }
+    }
+
+    sw.vaal    = vaal;
+    sw.load_ns = vaal_clock_now() - start;
+    reactor_notify(sw.event);
+}
+
+/**
+ * Requests a swap to the model at path, returns a description of the request
+ * state for the control channel.
+ */
+static const char*
+swap_start(model_swap& sw, const pipeline& pipe, const std::string& path)
+{
+    if (sw.loading) {
+        sw.pending = path;
+        return "queued";
+    }
+
+    if (verbose) { printf("loading model %s\n", path.c_str()); }
+
+    sw.loading      = true;
+    sw.loading_path = path;
+    sw.error.clear();
+    if (pipe.native) {
+        /* Only the user settings carry over, the layout comes from the model. */
+        sw.decoder                 = native::decoder();
+        sw.decoder.enabled         = pipe.native->enabled;
+        sw.decoder.type            = pipe.native->type;
+        sw.decoder.score_threshold = pipe.native->score_threshold;
+        sw.decoder.iou_threshold   = pipe.native->iou_threshold;
+        sw.decoder.top_k           = pipe.native->top_k;
+    }
+
+    sw.thread = std::thread(swap_load,
+                            std::ref(sw),
+                            pipe.native != NULL,
+                            int(pipe.boxes.size()));
+    return "loading";
+}
+
+static bool
+swap_labels_match(VAALContext* a, VAALContext* b)
+{
+    int count = vaal_label_count(a);
+    if (count != vaal_label_count(b)) { return false; }
+
+    for (int i = 0; i < count; i++) {
+        const char* la = vaal_label(a, i);
+        const char* lb = vaal_label(b, i);
+        if (strcmp(la ? la : "", lb ? lb : "")) { return false; }
+    }
+
+    return true;
+}
+
+/**
+ * Called by the reactor once the loading thread is done, switches the pipeline
+ * to the new context and starts any queued request.
+ */
+static int
+swap_finish(model_swap& sw, pipeline& pipe)
+{
+    sw.thread.join();
+    sw.loading = false;
+
+    VAALContext* vaal = sw.vaal;
+    sw.vaal           = NULL;
+
+    bool labels = pipe.filter || pipe.zones || pipe.tracks || pipe.lines ||
+                  pipe.classify || pipe.gate || pipe.label_ids || pipe.ring ||
+                  pipe.history || pipe.archive;
+    if (vaal && labels && !swap_labels_match(pipe.vaal, vaal)) {
+        sw.error = "model labels differ from the current model";
+        vaal_context_release(vaal);
+        vaal = NULL;
+    }
+
+    if (!vaal) {
+        fprintf(stderr,
+                "model swap to %s failed: %s\n",
+                sw.loading_path.c_str(),
+                sw.error.c_str());
+    } else {
+        VAALContext* previous = pipe.vaal;
+        const char*  path     = sw.loading_path.c_str();
+
+        pipe.vaal  = vaal;
+        pipe.model = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        if (pipe.native) { *pipe.native = sw.decoder; }
+        label_intern(pipe.labels, vaal);
+        control_apply(pipe, int(pipe.boxes.size()));
+        vaal_context_release(previous);
+        if (sw.swapped) { sw.swapped(); }
+
+        sw.path = sw.loading_path;
+        if (verbose) {
+            printf("swapped to model %s loaded in %.3fs\n",
+                   path,
+                   sw.load_ns / double(NSEC_PER_SEC));
+        }
+    }
+
+    if (!sw.pending.empty()) {
+        std::string path = sw.pending;
+        sw.pending.clear();
+        swap_start(sw, pipe, path);
+    }
+
+    return 0;
+}
+
+/**
+ * Watches the directory of the model for the model file being written or
+ * renamed into place, which covers both copying over the file and the atomic
+ * replace done by most update tools.
+ */
+static int
+swap_watch(model_swap& sw)
+{
+    std::string dir = sw.path;
+    size_t      pos = dir.rfind('/');
+    dir             = pos == std::string::npos ? "." : dir.substr(0, pos + 1);
+
+    sw.inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (sw.inotify < 0 ||
+        inotify_add_watch(sw.inotify,
+                          dir.c_str(),
+                          IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr,
+                "failed to watch model directory %s: %s\n",
+                dir.c_str(),
+                strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Reads the inotify events and starts a swap when the model file changed.
+ */
+static int
+swap_watch_handle(model_swap& sw, const pipeline& pipe)
+{
+    alignas(struct inotify_event) char buffer[4096];
+
+    const char* name = strrchr(sw.path.c_str(), '/');
+    name             = name ? name + 1 : sw.path.c_str();
+    bool changed     = false;
+
+    for (;;) {
+        ssize_t len = read(sw.inotify, buffer, sizeof(buffer));
+        if (len <= 0) { break; }
+
+        for (char* ptr = buffer; ptr < buffer + len;) {
+            auto event = (const struct inotify_event*) ptr;
+            if (event->len && !strcmp(event->name, name)) { changed = true; }
+            ptr += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    if (changed) { swap_start(sw, pipe, sw.path); }
+    return 0;
+}
+
+/**
+ * The control channel is a ZeroMQ REP socket accepting JSON commands to query
+ * and change the settings while running, for example:
+ *
+ *     {"command": "get"}
+ *     {"command": "set", "score_threshold": 0.4, "topic": "PEOPLE"}
+ *     {"command": "swap", "model": "/usr/share/models/new.rtm"}
+ *
+ * Commands are handled by the reactor between frames, so a change applies to
+ * the whole next frame without any locking.  A set command is validated in
+ * full before anything is changed and every reply includes the resulting
+ * configuration, or an error.
+ */
+struct control {
+    pipeline*                           pipe    = NULL;
+    model_swap*                         swap    = NULL;
+    std::map<std::string, std::string*> topics;
+    const int64_t*                      dropped = NULL;
+    int64_t                             started = 0;
+    std::function<void()>               labels;
+
+    // The binary part of the reply, sent after the json part when not empty.
+    std::string data;
+};
+
+static json
+control_config(const control& ctl)
+{
+    const pipeline& pipe = *ctl.pipe;
+
+    json config = {
+        {"model", pipe.model},
+        {"score_threshold", pipe.threshold},
+        {"iou_threshold", pipe.iou},
+        {"max_detection", pipe.boxes.size()},
+        {"frame_skip", pipe.skip},
+    };
+    for (auto& topic : ctl.topics) { config[topic.first] = *topic.second; }
+
+    return config;
+}
+
+static json
+control_stats(const control& ctl)
+{
+    const pipeline& pipe = *ctl.pipe;
+
+    return {
+        {"uptime_ns", vaal_clock_now() - ctl.started},
+        {"fps", pipe.fps},
+        {"frames", pipe.frames},
+        {"skipped", pipe.skipped},
+        {"dropped", ctl.dropped ? *ctl.dropped : 0},
+        {"first_result_ns", pipe.first_ns},
+        {"suppressed", pipe.policy ? pipe.policy->suppressed : 0},
+    };
+}
+
+/**
+ * Forgets the last value of a topic which is being renamed, unless another
+ * setting still publishes on it, so the cache only ever holds the configured
+ * topics.
+ */
+static void
+last_value_drop(const control& ctl, const std::string& name)
+{
+    int users = 0;
+    for (auto& topic : ctl.topics) { users += *topic.second == name; }
+    if (users < 2) { last_values.erase(name); }
+}
+
+static json
+control_command(control& ctl, const json& request)
+{
+    pipeline&   pipe    = *ctl.pipe;
+    std::string command = request.value("command", "");
+
+    if (command == "get") {
+        return {{"config", control_config(ctl)}, {"stats", control_stats(ctl)}};
+    }
+
+    if (command == "swap" && ctl.swap) {
+        std::string path  = request.value("model", ctl.swap->path);
+        const char* state = swap_start(*ctl.swap, pipe, path);
+        return {{"swap", state}, {"model", path}};
+    }
+
+    if (command == "history" && pipe.history) {
+        return {{"results", history_query(*pipe.history, pipe, request)}};
+    }
+
+    if (command == "crop" && pipe.held) {
+        int64_t      serial = request.value("serial", int64_t(-1));
+        input_frame* frame  = frame_find(*pipe.held, serial);
+        if (!frame) { return {{"error", "frame is no longer held"}}; }
+
+        json        info;
+        auto        bbox  = request.at("bbox").get<data::box>();
+        const char* error = frame_crop(*frame, bbox, info, ctl.data);
+        if (error) { return {{"error", error}}; }
+        return {{"crop", info}};
+    }
+
+    if (command == "labels") {
+        if (ctl.labels) { ctl.labels(); }
+        return {{"labels", label_table(pipe)}};
+    }
+
+    if (command != "set") { return {{"error", "unknown command"}}; }
+
+    float threshold = request.value("score_threshold", pipe.threshold);
+    float iou       = request.value("iou_threshold", pipe.iou);
+    int   max_boxes = request.value("max_detection", int(pipe.boxes.size()));
+    int   skip      = request.value("frame_skip", pipe.skip);
+
+    if (threshold < 0.0f || threshold > 1.0f) {
+        return {{"error", "score_threshold must be between 0 and 1"}};
+    }
+    if (iou < 0.0f || iou > 1.0f) {
+        return {{"error", "iou_threshold must be between 0 and 1"}};
+    }
+    if (max_boxes < 1) { return {{"error", "max_detection must be positive"}}; }
+    if (skip < 0) { return {{"error", "frame_skip must not be negative"}}; }
+    if (pipe.filter && threshold != pipe.threshold) {
+        return {{"error", "score_threshold is set per class by the filter"}};
+    }
+
+    for (auto& item : request.items()) {
+        if (item.key() == "command") { continue; }
+        if (ctl.topics.count(item.key()) && item.value().is_string()) {
+            continue;
+        }
+        if (item.key() == "score_threshold" || item.key() == "iou_threshold" ||
+            item.key() == "max_detection" || item.key() == "frame_skip") {
+            continue;
+        }
+        return {{"error", "invalid setting " + item.key()}};
+    }
+
+    for (auto& topic : ctl.topics) {
+        if (!request.contains(topic.first)) { continue; }
+        last_value_drop(ctl, *topic.second);
+        *topic.second = request[topic.first].get<std::string>();
+    }
+
+    pipe.threshold = threshold;
+    pipe.iou       = iou;
+    pipe.skip      = skip;
+    control_apply(pipe, max_boxes);
+
+    if (verbose) {
+        printf("control changed settings: %s\n",
+               control_config(ctl).dump().c_str());
+    }
+
+    return {{"config", control_config(ctl)}};
+}
+
+/**
+ * Receives a command from the control socket and sends the reply, a REP socket
+ * must answer every request so malformed requests also get an error reply.
+ */
+static int
+control_handle(control& ctl, zmq::socket_t& socket)
+{
+    zmq::message_t request;
+    if (!socket.recv(request, zmq::recv_flags::dontwait)) { return 0; }
+
+    json reply;
+    ctl.data.clear();
+    try {
+        reply = control_command(ctl, json::parse(request.to_string()));
+    } catch (const json::exception& err) {
+        reply = {{"error", err.what()}};
+        ctl.data.clear();
+    }
+
+    auto message = reply.dump();
+    if (ctl.data.empty()) {
+        socket.send(zmq::buffer(message), zmq::send_flags::dontwait);
+        return 0;
+    }
+
+    auto more = zmq::send_flags::sndmore | zmq::send_flags::dontwait;
+    socket.send(zmq::buffer(message), more);
+    socket.send(zmq::buffer(ctl.data), zmq::send_flags::dontwait);
+    return 0;
+}
+
+/**
+ * The libjpeg errors jump back to snapshot_compress instead of exiting.
+ */
+struct snapshot_error {
+    struct jpeg_error_mgr mgr;
+    jmp_buf               jump;
+};
+
+static void
+snapshot_error_exit(j_common_ptr cinfo)
+{
+    char message[JMSG_LENGTH_MAX];
+    cinfo->err->format_message(cinfo, message);
+    fprintf(stderr, "failed to encode snapshot: %s\n", message);
+    longjmp(((snapshot_error*) cinfo->err)->jump, 1);
+}
+
+/**
+ * Converts row y of the rectangle into the scanline, YUV formats are passed to
+ * libjpeg as YCbCr so only the chroma is upsampled, and RGB formats as RGB.
+ */
+static void
+snapshot_row(const input_frame& frame,
+             const uint8_t*     data,
+             const int          rect[4],
+             int                y,
+             uint8_t*           out)
+{
+    size_t         stride = size_t(frame.stride);
+    const uint8_t* row    = data + y * stride;
+    const uint8_t* src    = row;
+
+    for (int x = rect[0]; x < rect[2]; x++, out += 3) {
+        switch (frame.fourcc) {
+        case v4l2_fourcc('N', 'V', '1', '2'):
+        case v4l2_fourcc('N', 'V', '2', '1'): {
+            const uint8_t* uv = data + stride * (frame.height + y / 2) +
+                                (x & ~1);
+            bool nv21 = frame.fourcc == v4l2_fourcc('N', 'V', '2', '1');
+            out[0]    = row[x];
+            out[1]    = uv[nv21 ? 1 : 0];
+            out[2]    = uv[nv21 ? 0 : 1];
+            break;
+        }
+        case v4l2_fourcc('U', 'Y', 'V', 'Y'):
+            src    = row + (x & ~1) * 2;
+            out[0] = src[x & 1 ? 3 : 1];
+            out[1] = src[0];
+            out[2] = src[2];
+            break;
+        case v4l2_fourcc('Y', 'U', 'Y', 'V'):
+        case v4l2_fourcc('Y', 'U', 'Y', '2'):
+            src    = row + (x & ~1) * 2;
+            out[0] = src[x & 1 ? 2 : 0];
+            out[1] = src[1];
+            out[2] = src[3];
+            break;
+        case v4l2_fourcc('R', 'G', 'B', '3'):
+        case v4l2_fourcc('B', 'G', 'R', '3'):
+        case v4l2_fourcc('R', 'G', 'B', 'A'):
+        case v4l2_fourcc('B', 'G', 'R', 'A'):
+        case v4l2_fourcc('R', 'G', 'B', 'X'):
+        case v4l2_fourcc('B', 'G', 'R', 'X'): {
+            int  bpp = (frame.fourcc >> 24) == '3' ? 3 : 4;
+            bool bgr = (frame.fourcc & 0xff) == 'B';
+            src      = row + x * bpp;
+            out[0]   = src[bgr ? 2 : 0];
+            out[1]   = src[1];
+            out[2]   = src[bgr ? 0 : 2];
+            break;
+        }
+        default:
+            out[0] = out[1] = out[2] = row[x];
+            break;
+        }
+    }
+}
+
+/**
+ * Encodes the rectangle of the mapped frame into a JPEG stored in *jpeg, which
+ * the caller must free.  No C++ object may live in this function as libjpeg
+ * errors longjmp back to it.
+ */
+static int
+snapshot_compress(const input_frame& frame,
+                  const uint8_t*     data,
+                  const int          rect[4],
+                  int                quality,
+                  uint8_t*           row,
+                  unsigned char**    jpeg,
+                  unsigned long*     size)
+{
+    struct jpeg_compress_struct cinfo;
+    snapshot_error              err;
+
+    cinfo.err           = jpeg_std_error(&err.mgr);
+    err.mgr.error_exit  = snapshot_error_exit;
+    if (setjmp(err.jump)) {
+        jpeg_destroy_compress(&cinfo);
+        return -1;
+    }
+
+    bool grey = frame.fourcc == v4l2_fourcc('G', 'R', 'E', 'Y');
+    bool rgb  = (frame.fourcc & 0xff) == 'R' || (frame.fourcc & 0xff) == 'B';
+
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, jpeg, size);
+    cinfo.image_width      = rect[2] - rect[0];
+    cinfo.image_height     = rect[3] - rect[1];
+    cinfo.input_components = grey ? 1 : 3;
+    cinfo.in_color_space   = grey ? JCS_GRAYSCALE : rgb ? JCS_RGB : JCS_YCbCr;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, quality, TRUE);
+    jpeg_start_compress(&cinfo, TRUE);
+
+    for (int y = rect[1]; y < rect[3]; y++) {
+        JSAMPROW line = row;
+        if (grey) {
+            line = (JSAMPROW) data + size_t(y) * frame.stride + rect[0];
+        } else {
+            snapshot_row(frame, data, rect, y, row);
+        }
+        jpeg_write_scanlines(&cinfo, &line, 1);
+    }
+
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+    return 0;
+}
+
+/**
+ * Encodes the job's frame, releases it then queues the snapshot for the reactor
+ * thread to publish.
+ */
+static void
+snapshot_encode(snapshot_pool& pool, snapshot_job& job)
+{
+    int64_t        start  = vaal_clock_now();
+    input_frame&   frame  = job.frame;
+    frame_layout   layout;
+    int            rect[4];
+    const uint8_t* data   = NULL;
+    size_t         size   = 0;
+    const char*    error  = NULL;
+    unsigned char* jpeg   = NULL;
+    unsigned long  length = 0;
+
+    if (frame_layout_of(frame.fourcc, layout)) {
+        error = "unsupported frame format";
+    } else if (frame_region(frame, layout, job.info.bbox, rect)) {
+        error = "empty snapshot";
+    } else {
+        error = frame_map(frame, layout, &data, &size);
+    }
+
+    if (error) {
+        fprintf(stderr, "failed to snapshot frame: %s\n", error);
+        frame.release();
+        return;
+    }
+
+    std::vector<uint8_t> row(size_t(rect[2] - rect[0]) * 3);
+    int err = snapshot_compress(frame,
+                                data,
+                                rect,
+                                pool.quality,
+                                row.data(),
+                                &jpeg,
+                                &length);
+    frame_unmap(frame, data, size);
+    frame.release();
+
+    if (!err) {
+        job.info.width     = rect[2] - rect[0];
+        job.info.height    = rect[3] - rect[1];
+        job.info.encode_ns = vaal_clock_now() - start;
+        job.info.size      = length;
+
+        std::lock_guard<std::mutex> guard(pool.lock);
+        pool.done.push_back(job);
+        pool.images.push_back(std::string((const char*) jpeg, length));
+    }
+    free(jpeg);
+
+    if (!err) { reactor_notify(pool.event); }
+}
+
+static void
+snapshot_worker(snapshot_pool& pool)
+{
+    for (;;) {
+        snapshot_job job;
+        {
+            std::unique_lock<std::mutex> guard(pool.lock);
+            pool.ready.wait(guard, [&pool]() {
+                return pool.stop || !pool.pending.empty();
+            });
+            if (pool.pending.empty()) { return; }
+            job = pool.pending.front();
+            pool.pending.pop_front();
+        }
+        snapshot_encode(pool, job);
+    }
+}
+
+/**
+ * Publishes each encoded snapshot as a two part message, the topic and the
+ * JSON description then the JPEG image, so subscribers need not parse the
+ * image out of the message.  Only the description is echoed with --verbose.
+ * Snapshots are published outside of publish() as the last value cache does
+ * not keep them, an image of a past event is of no use to a subscriber which
+ * joins later.
+ */
+static int
+snapshot_publish(snapshot_pool& pool, zmq::socket_t& pub)
+{
+    std::vector<snapshot_job> done;
+    std::vector<std::string>  images;
+    {
+        std::lock_guard<std::mutex> guard(pool.lock);
+        done.swap(pool.done);
+        images.swap(pool.images);
+    }
+
+    for (size_t i = 0; i < done.size(); i++) {
+        if (pool.topic.empty()) { continue; }
+
+        json payload = done[i].info;
+        auto message = pool.topic + payload.dump();
+        if (verbose) { std::cout << message << std::endl; }
+        pub.send(zmq::buffer(message), zmq::send_flags::sndmore);
+        pub.send(zmq::buffer(images[i]));
+    }
+
+    return 0;
+}
+
+static void
+snapshot_start(snapshot_pool& pool)
+{
+    for (size_t i = 0; i < pool.jobs; i++) {
+        pool.workers.push_back(std::thread(snapshot_worker, std::ref(pool)));
+    }
+}
+
+/**
+ * Stops the workers once the queued snapshots are encoded.
+ */
+static void
+snapshot_stop(snapshot_pool& pool)
+{
+    {
+        std::lock_guard<std::mutex> guard(pool.lock);
+        pool.stop = true;
+    }
+    pool.ready.notify_all();
+    for (auto& worker : pool.workers) { worker.join(); }
+    pool.workers.clear();
+}
+
+/**
+ * Unlocks and releases a frame of the client, only on the capture thread.
+ */
+static void
+vsl_release(VSLFrame* frame)
+{
+    vsl_frame_unlock(frame);
+    vsl_frame_release(frame);
+    vsl_held--;
+}
+
+/**
+ * Releases the frames the pipeline returned, only on the capture thread.
+ */
+static void
+vsl_drain()
+{
+    std::vector<VSLFrame*> frames;
+    {
+        std::lock_guard<std::mutex> guard(vsl_lock);
+        frames.swap(vsl_returned);
+    }
+    for (auto frame : frames) { vsl_release(frame); }
+}
+
+/**
+ * Returns the videostream frame to the capture thread once the pipeline is
+ * done with it, from whichever thread held it last.
+ */
+static void
+vsl_done(input_frame& input)
+{
+    std::lock_guard<std::mutex> guard(vsl_lock);
+    vsl_returned.push_back((VSLFrame*) input.source);
+    vsl_released.notify_all();
+}
+
+/**
+ * The videostream library has no file descriptor to wait on so frames are
+ * received by a capture thread which hands over the latest frame and wakes the
+ * reactor through an eventfd.  A frame still waiting when the next one arrives
+ * is dropped so the model always works on the most recent frame.
+ *
+ * When the host goes away, for example when the camera pipeline is restarted,
+ * the capture thread reconnects with an exponential backoff while the models
+ * stay loaded.  The host is considered lost when vsl_frame_wait fails with an
+ * error other than a timeout or when no frame arrives for the stall period.
+ * Connection state changes are queued for the reactor thread to publish.
+ *
+ * The frames held by the pipeline come from the host's pool of buffers, which
+ * is given as buffers so configurations holding too many frames are rejected.
+ */
+struct vsl_capture {
+    const char*                   path    = NULL;
+    std::string                   topic   = "CONNECTION";
+    int64_t                       stall   = 2 * NSEC_PER_SEC;
+    int64_t                       backoff = 10 * NSEC_PER_SEC / 1000;
+    int64_t                       limit   = NSEC_PER_SEC;
+    int                           event   = -1;
+    VSLFrame*                     frame   = NULL;
+    int64_t                       dropped = 0;
+    size_t                        buffers = 12;
+    std::vector<data::connection> states;
+    std::mutex                    lock;
+    std::thread                   thread;
+};
+
+static void
+vsl_capture_state(vsl_capture& cap,
+                  const char*  state,
+                  int64_t      attempts,
+                  int64_t      downtime)
+{
+    if (verbose) {
+        printf("videostream %s %s after %lld attempts and %.3fs\n",
+               cap.path,
+               state,
+               (long long) attempts,
+               downtime / double(NSEC_PER_SEC));
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(cap.lock);
+        cap.states.push_back({
+            .timestamp   = vaal_clock_now(),
+            .source      = cap.path,
+            .state       = state,
+            .attempts    = attempts,
+            .downtime_ns = downtime,
+        });
+    }
+
+    reactor_notify(cap.event);
+}
+
+/**
+ * Releases the lost client, once the pipeline has returned every frame, then
+ * connects again with a backoff doubling up to the limit.  Returns once
+ * connected or when the application is stopping.
+ */
+static void
+vsl_capture_reconnect(vsl_capture& cap)
+{
+    int64_t lost = vaal_clock_now();
+    vsl_capture_state(cap, "disconnected", 0, 0);
+
+    {
+        std::lock_guard<std::mutex> guard(cap.lock);
+        if (cap.frame) {
+            vsl_release(cap.frame);
+            cap.frame = NULL;
+        }
+    }
+
+    /**
+     * The frames are released here as the pipeline returns them.  The wait is
+     * bounded so a quit request, which cannot signal the condition variable
+     * from a signal handler, is still noticed.
+     */
+    vsl_drain();
+    while (running && vsl_held > 0) {
+        {
+            std::unique_lock<std::mutex> guard(vsl_lock);
+            vsl_released.wait_for(guard, milliseconds(100), [] {
+                return !vsl_returned.empty();
+            });
+        }
+        vsl_drain();
+    }
+
+    VSLClient* client = vsl;
+    vsl               = NULL;
+    if (client) { vsl_client_release(client); }
+
+    int64_t backoff  = cap.backoff;
+    int64_t attempts = 0;
+
+    while (running) {
+        attempts++;
+        client = vsl_client_init(cap.path, NULL, true);
+        if (client) { break; }
+
+        /**
+         * Sleep in short steps so a quit request is noticed quickly.
+         */
+        int64_t until = vaal_clock_now() + backoff;
+        while (running && vaal_clock_now() < until) {
+            std::this_thread::sleep_for(milliseconds(10));
+        }
+        backoff = std::min(backoff * 2, cap.limit);
+    }
+
+    if (!client) { return; }
+
+    vsl_client_set_timeout(client, 0.1f);
+    vsl = client;
+
+    vsl_capture_state(cap, "connected", attempts, vaal_clock_now() - lost);
+}
+
+static void
+vsl_capture_thread(vsl_capture& cap)
+{
+    int64_t last = vaal_clock_now();
+
+    while (running) {
+        /**
+         * The vsl_frame_wait function will block until the next frame is
+         * received or the 100ms timeout expires.
+         *
+         * IMPORTANT: vsl_frame_release must be called on the VSLFrame returned
+         * by this function.  Failure to do so will result in leaked file
+         * descriptors and the eventual termination of the application by the
+         * operating system.
+         */
+        VSLFrame* frame = vsl_frame_wait(vsl, 0);
+        vsl_drain();
+        if (!frame) {
+            bool timeout = errno == ETIMEDOUT || errno == EAGAIN ||
+                           errno == EINTR;
+            if (running &&
+                (!timeout || vaal_clock_now() - last > cap.stall)) {
+                vsl_capture_reconnect(cap);
+                last = vaal_clock_now();
+            }
+            continue;
+        }
+        last = vaal_clock_now();
+
+        /**
+         * The vsl_frame_trylock will attempt to lock the frame so that it can
+         * live longer than the default lifespan, typically 100ms.  The frame is
+         * handed to the reactor thread and may also be held by the ensemble
+         * and classifier stages so it must be locked.
+         */
+        if (vsl_frame_trylock(frame)) {
+            fprintf(stderr, "failed to lock frame: %s\n", strerror(errno));
+            vsl_frame_release(frame);
+            continue;
+        }
+
+        VSLFrame* previous;
+        vsl_held++;
+        {
+            std::lock_guard<std::mutex> guard(cap.lock);
+            previous  = cap.frame;
+            cap.frame = frame;
+            if (previous) { cap.dropped++; }
+        }
+
+        if (previous) { vsl_release(previous); }
+
+        reactor_notify(cap.event);
+    }
+}
+
+/**
+ * This function is where we take the videostream frame from the capture thread
+ * and pass it on to process_frame for model inferencing with VisionPack VAAL.
+ */
+static int
+handle_vsl(zmq::socket_t&     pub,
+           const std::string& topic,
+           const std::string& capture,
+           pipeline&          pipe,
+           vsl_capture&       cap)
+{
+    VSLFrame*                     frame;
+    std::vector<data::connection> states;
+    {
+        std::lock_guard<std::mutex> guard(cap.lock);
+        frame     = cap.frame;
+        cap.frame = NULL;
+        states.swap(cap.states);
+    }
+
+    /**
+     * The held frames must be returned before the capture thread can release
+     * the lost client.  The states are published ahead of the frame's result
+     * and queued with it, so a reconnection is never hidden by the result.
+     */
+    for (auto& state : states) {
+        if (pipe.held && state.state == "disconnected") {
+            frame_clear(*pipe.held);
+        }
+        if (pipe.stream && state.state == "connected") {
+            pipe.stream->changed = true;
+        }
+        json payload = state;
+        publish(pub, cap.topic, payload.dump());
+    }
+
+    if (!frame) { return 0; }
+
+    input_frame input = {
+        .fd        = vsl_frame_handle(frame),
+        .memory    = NULL,
+        .path      = NULL,
+        .fourcc    = vsl_frame_fourcc(frame),
+        .width     = vsl_frame_width(frame),
+        .height    = vsl_frame_height(frame),
+        .stride    = vsl_frame_stride(frame),
+        .timestamp = vsl_frame_timestamp(frame),
+        .serial    = vsl_frame_serial(frame),
+        .source    = frame,
+        .index     = 0,
+        .done      = vsl_done,
+        .hold      = true,
+    };
+
+    return process_frame(pub, topic, capture, pipe, input);
+}
+
+/**
+ * Stops the capture thread and releases the frames it left behind, the calling
+ * thread is the only one left using the videostream library.
+ */
+static void
+vsl_capture_stop(vsl_capture& cap)
+{
+    if (cap.thread.joinable()) { cap.thread.join(); }
+    if (cap.frame) {
+        vsl_release(cap.frame);
+        cap.frame = NULL;
+    }
+    vsl_drain();
+}
+
+/**
+ * The v4l2 capture reads frames directly from a video device, skipping the
+ * GStreamer and vslsink processes otherwise needed to feed the videostream
+ * socket.  The driver's buffers are exported as DMA file descriptors using
+ * VIDIOC_EXPBUF once at startup so each frame is handed to the model the same
+ * way as a videostream frame.  A buffer is queued back to the driver when the
+ * pipeline releases the frame, so the number of buffers bounds how many frames
+ * the ensemble and classifier stages can hold on to.
+ */
+struct v4l2_capture {
+    const char*      device  = "/dev/video0";
+    int              fd      = -1;
+    uint32_t         type    = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    uint32_t         fourcc  = 0;
+    int              width   = 0;
+    int              height  = 0;
+    int              stride  = 0;
+    int              buffers = 4;
+    float            fps     = 0.0f;
+    std::vector<int> dmabufs;
+};
+
+static int
+v4l2_ioctl(int fd, unsigned long request, void* arg)
+{
+    int err;
+    do {
+        err = ioctl(fd, request, arg);
+    } while (err == -1 && errno == EINTR);
+    return err;
+}
+
+/**
+ * Parses the WIDTHxHEIGHT capture size, returns non-zero if invalid.
+ */
+static int
+v4l2_parse_size(v4l2_capture& cap, const char* size)
+{
+    if (sscanf(size, "%dx%d", &cap.width, &cap.height) != 2) { return -1; }
+    if (cap.width <= 0 || cap.height <= 0) { return -1; }
+    return 0;
+}
+
+/**
+ * Parses the capture format as a fourcc string such as YUYV or NV12.
+ */
+static int
+v4l2_parse_format(v4l2_capture& cap, const char* format)
+{
+    if (strlen(format) != 4) { return -1; }
+    cap.fourcc = v4l2_fourcc(format[0], format[1], format[2], format[3]);
+    return 0;
+}
+
+static void
+v4l2_close(v4l2_capture& cap)
+{
+    if (cap.fd < 0) { return; }
+
+    uint32_t type = cap.type;
+    v4l2_ioctl(cap.fd, VIDIOC_STREAMOFF, &type);
+
+    for (int dmabuf : cap.dmabufs) {
+        if (dmabuf >= 0) { close(dmabuf); }
+    }
+    cap.dmabufs.clear();
+
+    struct v4l2_requestbuffers req = {};
+    req.count                      = 0;
+    req.type                       = cap.type;
+    req.memory                     = V4L2_MEMORY_MMAP;
+    v4l2_ioctl(cap.fd, VIDIOC_REQBUFS, &req);
+
+    close(cap.fd);
+    cap.fd = -1;
+}
+
+static int
+v4l2_queue(v4l2_capture& cap, int index)
+{
+    struct v4l2_plane  plane = {};
+    struct v4l2_buffer buf   = {};
+    buf.type                 = cap.type;
+    buf.memory               = V4L2_MEMORY_MMAP;
+    buf.index                = index;
+    if (cap.type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        buf.m.planes = &plane;
+        buf.length   = 1;
+    }
+    return v4l2_ioctl(cap.fd, VIDIOC_QBUF, &buf);
+}
+
+/**
+ * Opens the video device, negotiates the format and queues the exported
+ * buffers.  Both single and multi-planar drivers are supported though only
+ * formats which fit in a single plane, which covers the packed and
+ * semi-planar formats accepted by vaal_load_frame_dmabuf.
+ */
+static int
+v4l2_open(v4l2_capture& cap)
+{
+    cap.fd = open(cap.device, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (cap.fd < 0) {
+        fprintf(stderr,
+                "failed to open video device %s: %s\n",
+                cap.device,
+                strerror(errno));
+        return -1;
+    }
+
+    struct v4l2_capability caps = {};
+    if (v4l2_ioctl(cap.fd, VIDIOC_QUERYCAP, &caps)) {
+        fprintf(stderr,
+                "failed to query video device %s: %s\n",
+                cap.device,
+                strerror(errno));
+        v4l2_close(cap);
+        return -1;
+    }
+
+    uint32_t flags = caps.capabilities;
+    if (flags & V4L2_CAP_DEVICE_CAPS) { flags = caps.device_caps; }
+
+    if (flags & V4L2_CAP_VIDEO_CAPTURE) {
+        cap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    } else if (flags & V4L2_CAP_VIDEO_CAPTURE_MPLANE) {
+        cap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    } else {
+        fprintf(stderr, "%s is not a video capture device\n", cap.device);
+        v4l2_close(cap);
+        return -1;
+    }
+
+    if (!(flags & V4L2_CAP_STREAMING)) {
+        fprintf(stderr, "%s does not support streaming\n", cap.device);
+        v4l2_close(cap);
+        return -1;
+    }
+
+    /**
+     * The format is only changed when requested on the command line, otherwise
+     * the device keeps its current format.
+     */
+    struct v4l2_format fmt = {};
+    fmt.type               = cap.type;
+    if (v4l2_ioctl(cap.fd, VIDIOC_G_FMT, &fmt)) {
+        fprintf(stderr,
+                "failed to get format of %s: %s\n",
+                cap.device,
+                strerror(errno));
+        v4l2_close(cap);
+        return -1;
+    }
+
+    bool mplane = cap.type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    if (cap.fourcc || cap.width) {
+        if (mplane) {
+            if (cap.fourcc) { fmt.fmt.pix_mp.pixelformat = cap.fourcc; }
+            if (cap.width) {
+                fmt.fmt.pix_mp.width  = cap.width;
+                fmt.fmt.pix_mp.height = cap.height;
+            }
+            fmt.fmt.pix_mp.num_planes = 1;
+        } else {
+            if (cap.fourcc) { fmt.fmt.pix.pixelformat = cap.fourcc; }
+            if (cap.width) {
+                fmt.fmt.pix.width  = cap.width;
+                fmt.fmt.pix.height = cap.height;
+            }
+        }
+
+        if (v4l2_ioctl(cap.fd, VIDIOC_S_FMT, &fmt)) {
+            fprintf(stderr,
+                    "failed to set format of %s: %s\n",
+                    cap.device,
+                    strerror(errno));
+            v4l2_close(cap);
+            return -1;
+        }
+    }
+
+    uint32_t fourcc = mplane ? fmt.fmt.pix_mp.pixelformat
+                             : fmt.fmt.pix.pixelformat;
+    cap.width       = mplane ? fmt.fmt.pix_mp.width : fmt.fmt.pix.width;
+    cap.height      = mplane ? fmt.fmt.pix_mp.height : fmt.fmt.pix.height;
+    cap.stride      = mplane ? fmt.fmt.pix_mp.plane_fmt[0].bytesperline
+                             : fmt.fmt.pix.bytesperline;
+
+    if (mplane && fmt.fmt.pix_mp.num_planes != 1) {
+        fprintf(stderr,
+                "%s format uses %d planes, only single plane supported\n",
+                cap.device,
+                fmt.fmt.pix_mp.num_planes);
+        v4l2_close(cap);
+        return -1;
+    }
+
+    if (cap.fourcc && cap.fourcc != fourcc) {
+        fprintf(stderr,
+                "%s does not support format %.4s\n",
+                cap.device,
+                (const char*) &cap.fourcc);
+        v4l2_close(cap);
+        return -1;
+    }
+    cap.fourcc = fourcc;
+
+    // The frame rate is only informative, drivers which do not report it
+    // leave it at 0.
+    struct v4l2_streamparm parm = {};
+    parm.type                   = cap.type;
+    if (!v4l2_ioctl(cap.fd, VIDIOC_G_PARM, &parm)) {
+        const struct v4l2_fract& frame = parm.parm.capture.timeperframe;
+        if (frame.numerator) {
+            cap.fps = float(frame.denominator) / frame.numerator;
+        }
+    }
+
+    struct v4l2_requestbuffers req = {};
+    req.count                      = cap.buffers;
+    req.type                       = cap.type;
+    req.memory                     = V4L2_MEMORY_MMAP;
+    if (v4l2_ioctl(cap.fd, VIDIOC_REQBUFS, &req) || req.count < 2) {
+        fprintf(stderr,
+                "failed to request %d buffers from %s: %s\n",
+                cap.buffers,
+                cap.device,
+                strerror(errno));
+        v4l2_close(cap);
+        return -1;
+    }
+
+    /**
+     * The exported file descriptors stay valid for the lifetime of the
+     * buffers, so the export is done once rather than for every frame.
+     */
+    cap.dmabufs.assign(req.count, -1);
+    for (uint32_t i = 0; i < req.count; i++) {
+        struct v4l2_exportbuffer expbuf = {};
+        expbuf.type                     = cap.type;
+        expbuf.index                    = i;
+        expbuf.plane                    = 0;
+        expbuf.flags                    = O_RDONLY | O_CLOEXEC;
+        if (v4l2_ioctl(cap.fd, VIDIOC_EXPBUF, &expbuf)) {
+            fprintf(stderr,
+                    "failed to export buffer %u of %s: %s\n",
+                    i,
+                    cap.device,
+                    strerror(errno));
+            v4l2_close(cap);
+            return -1;
+        }
+        cap.dmabufs[i] = expbuf.fd;
+
+        if (v4l2_queue(cap, i)) {
+            fprintf(stderr,
+                    "failed to queue buffer %u of %s: %s\n",
+                    i,
+                    cap.device,
+                    strerror(errno));
+            v4l2_close(cap);
+            return -1;
+        }
+    }
+
+    uint32_t type = cap.type;
+    if (v4l2_ioctl(cap.fd, VIDIOC_STREAMON, &type)) {
+        fprintf(stderr,
+                "failed to start streaming %s: %s\n",
+                cap.device,
+                strerror(errno));
+        v4l2_close(cap);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Queues the buffer back to the driver once the pipeline is done with it.
+ */
+static void
+v4l2_done(input_frame& input)
+{
+    v4l2_capture* cap = (v4l2_capture*) input.source;
+    if (v4l2_queue(*cap, input.index)) {
+        fprintf(stderr,
+                "failed to queue buffer %d of %s: %s\n",
+                input.index,
+                cap->device,
+                strerror(errno));
+    }
+}
+
+/**
+ * Reads the next frame from the video device, called by the reactor once the
+ * device is readable, and passes it on to process_frame for model inferencing.
+ */
+static int
+handle_v4l2(zmq::socket_t&     pub,
+            const std::string& topic,
+            const std::string& capture,
+            pipeline&          pipe,
+            v4l2_capture&      cap)
+{
+    struct v4l2_plane  plane = {};
+    struct v4l2_buffer buf   = {};
+    buf.type                 = cap.type;
+    buf.memory               = V4L2_MEMORY_MMAP;
+    if (cap.type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+        buf.m.planes = &plane;
+        buf.length   = 1;
+    }
+
+    if (v4l2_ioctl(cap.fd, VIDIOC_DQBUF, &buf)) {
+        if (errno == EAGAIN) { return 0; }
+        fprintf(stderr,
+                "failed to dequeue frame from %s: %s\n",
+                cap.device,
+                strerror(errno));
+        return -1;
+    }
+
+    if (buf.flags & V4L2_BUF_FLAG_ERROR) {
+        v4l2_queue(cap, buf.index);
+        return 0;
+    }
+
+    input_frame input = {
+        .fd        = cap.dmabufs[buf.index],
+        .memory    = NULL,
+        .path      = NULL,
+        .fourcc    = cap.fourcc,
+        .width     = cap.width,
+        .height    = cap.height,
+        .stride    = cap.stride,
+        .timestamp = buf.timestamp.tv_sec * NSEC_PER_SEC +
+                     buf.timestamp.tv_usec * 1000ll,
+        .serial    = buf.sequence,
+        .source    = &cap,
+        .index     = (int) buf.index,
+        .done      = v4l2_done,
+    };
+
+    return process_frame(pub, topic, capture, pipe, input);
+}
+
+/**
+ * The raw input reads frames from a file of back to back raw frames, such as
+ * recorded footage dumped by GStreamer's filesink, so it can be reprocessed as
+ * fast as the model allows rather than at the camera rate.  The file is mapped
+ * into memory and each frame copied into a buffer allocated from a dma-heap so
+ * it can be loaded by the hardware accelerated path of vaal_load_frame_dmabuf.
+ * When no dma-heap is available the frames are loaded directly from the
+ * mapping through vaal_load_frame_memory.
+ */
+struct raw_input {
+    const char* path   = NULL;
+    int         fd     = -1;
+    uint8_t*    map    = NULL;
+    size_t      size   = 0;
+    size_t      frame  = 0;
+    size_t      count  = 0;
+    size_t      next   = 0;
+    uint32_t    fourcc = v4l2_fourcc('N', 'V', '1', '2');
+    int         width  = 0;
+    int         height = 0;
+    float       fps    = 0.0f;
+    int         dmabuf = -1;
+    uint8_t*    buffer = NULL;
+};
+
+/**
+ * Returns the size in bytes of a frame for the supported raw formats, or zero
+ * if the format is not supported.
+ */
+static size_t
+raw_frame_size(uint32_t fourcc, int width, int height)
+{
+    size_t pixels = (size_t) width * height;
+
+    switch (fourcc) {
+    case v4l2_fourcc('N', 'V', '1', '2'):
+    case v4l2_fourcc('N', 'V', '2', '1'):
+    case v4l2_fourcc('I', '4', '2', '0'):
+    case v4l2_fourcc('Y', 'V', '1', '2'):
+        return pixels * 3 / 2;
+    case v4l2_fourcc('Y', 'U', 'Y', 'V'):
+    case v4l2_fourcc('Y', 'U', 'Y', '2'):
+    case v4l2_fourcc('U', 'Y', 'V', 'Y'):
+        return pixels * 2;
+    case v4l2_fourcc('R', 'G', 'B', '3'):
+    case v4l2_fourcc('B', 'G', 'R', '3'):
+        return pixels * 3;
+    case v4l2_fourcc('R', 'G', 'B', 'A'):
+    case v4l2_fourcc('B', 'G', 'R', 'A'):
+    case v4l2_fourcc('R', 'G', 'B', 'X'):
+    case v4l2_fourcc('B', 'G', 'R', 'X'):
+        return pixels * 4;
+    case v4l2_fourcc('G', 'R', 'E', 'Y'):
+        return pixels;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Allocates the frame buffer from the first available dma-heap, the CMA heap
+ * is preferred as the accelerators on some targets require contiguous memory.
+ */
+static int
+raw_alloc_dmabuf(raw_input& input)
+{
+    static const char* heaps[] = {
+        "/dev/dma_heap/linux,cma",
+        "/dev/dma_heap/reserved",
+        "/dev/dma_heap/system",
+    };
+
+    for (const char* heap : heaps) {
+        int fd = open(heap, O_RDWR | O_CLOEXEC);
+        if (fd < 0) { continue; }
+
+        struct dma_heap_allocation_data alloc = {};
+        alloc.len                             = input.frame;
+        alloc.fd_flags                        = O_RDWR | O_CLOEXEC;
+        int err = ioctl(fd, DMA_HEAP_IOCTL_ALLOC, &alloc);
+        close(fd);
+        if (err) { continue; }
+
+        void* buffer = mmap(NULL,
+                            input.frame,
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED,
+                            alloc.fd,
+                            0);
+        if (buffer == MAP_FAILED) {
+            close(alloc.fd);
+            continue;
+        }
+
+        input.dmabuf = alloc.fd;
+        input.buffer = (uint8_t*) buffer;
+        if (verbose) { printf("raw input frames loaded through %s\n", heap); }
+        return 0;
+    }
+
+    return -1;
+}
+
+static void
+raw_close(raw_input& input)
+{
+    if (input.buffer) { munmap(input.buffer, input.frame); }
+    if (input.dmabuf >= 0) { close(input.dmabuf); }
+    if (input.map) { munmap(input.map, input.size); }
+    if (input.fd >= 0) { close(input.fd); }
+
+    input.buffer = NULL;
+    input.dmabuf = -1;
+    input.map    = NULL;
+    input.fd     = -1;
+}
+
+static int
+raw_open(raw_input& input)
+{
+    input.frame = raw_frame_size(input.fourcc, input.width, input.height);
+    if (!input.frame) {
+        fprintf(stderr,
+                "unsupported raw input format %.4s or size %dx%d\n",
+                (const char*) &input.fourcc,
+                input.width,
+                input.height);
+        return -1;
+    }
+
+    input.fd = open(input.path, O_RDONLY | O_CLOEXEC);
+    if (input.fd < 0) {
+        fprintf(stderr,
+                "failed to open input %s: %s\n",
+                input.path,
+                strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(input.fd, &st)) {
+        fprintf(stderr,
+                "failed to stat input %s: %s\n",
+                input.path,
+                strerror(errno));
+        raw_close(input);
+        return -1;
+    }
+
+    input.size  = st.st_size;
+    input.count = input.size / input.frame;
+    if (!input.count) {
+        fprintf(stderr,
+                "input %s is smaller than a single %dx%d frame\n",
+                input.path,
+                input.width,
+                input.height);
+        raw_close(input);
+        return -1;
+    }
+
+    if (input.size % input.frame) {
+        fprintf(stderr,
+                "input %s has a trailing partial frame which is ignored\n",
+                input.path);
+    }
+
+    void* map = mmap(NULL, input.size, PROT_READ, MAP_PRIVATE, input.fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr,
+                "failed to map input %s: %s\n",
+                input.path,
+                strerror(errno));
+        raw_close(input);
+        return -1;
+    }
+
+    input.map = (uint8_t*) map;
+    madvise(input.map, input.size, MADV_SEQUENTIAL);
+
+    raw_alloc_dmabuf(input);
+
+    return 0;
+}
+
+/**
+ * Reads the next frame from the raw input and passes it on to process_frame.
+ * The reactor is stopped once the end of the file is reached.  Frames are
+ * timestamped from their position in the file when the input frame rate is
+ * known, otherwise when loaded.
+ */
+static int
+handle_raw(zmq::socket_t&     pub,
+           const std::string& topic,
+           const std::string& capture,
+           pipeline&          pipe,
+           raw_input&         input)
+{
+    if (input.next >= input.count) {
+        running = 0;
+        return 0;
+    }
+
+    size_t         index = input.next++;
+    const uint8_t* frame = input.map + index * input.frame;
+
+    /**
+     * The next frame is paged in by the kernel while this one is processed.
+     */
+    if (input.next < input.count) {
+        madvise(input.map + input.next * input.frame,
+                input.frame,
+                MADV_WILLNEED);
+    }
+
+    if (input.dmabuf >= 0) {
+        struct dma_buf_sync sync = {DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE};
+        ioctl(input.dmabuf, DMA_BUF_IOCTL_SYNC, &sync);
+        memcpy(input.buffer, frame, input.frame);
+        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE;
+        ioctl(input.dmabuf, DMA_BUF_IOCTL_SYNC, &sync);
+    }
+
+    int64_t timestamp = vaal_clock_now();
+    if (input.fps > 0) {
+        // Double keeps the timestamps distinct over hours of footage.
+        timestamp = int64_t(double(index) * NSEC_PER_SEC / input.fps);
+    }
+
+    // The raw frames are stored back to back without row padding.
+    frame_layout layout;
+    int          stride = 0;
+    if (!frame_layout_of(input.fourcc, layout)) {
+        stride = input.width * layout.bpp;
+    }
+
+    input_frame frame_input = {
+        .fd        = input.dmabuf,
+        .memory    = frame,
+        .path      = NULL,
+        .fourcc    = input.fourcc,
+        .width     = input.width,
+        .height    = input.height,
+        .stride    = stride,
+        .timestamp = timestamp,
+        .serial    = (int64_t) index,
+        .source    = &input,
+        .index     = (int) index,
+        .done      = NULL,
+    };
+
+    return process_frame(pub, topic, capture, pipe, frame_input);
+}
+
+/**
+ * The image mode runs the model over every JPEG and PNG image found under a
+ * directory, for example to validate a model against a dataset using the same
+ * post-processing as the live pipeline.  The images are shared by a pool of
+ * workers each with their own VAALContext so decoding an image on one worker
+ * overlaps inference on the others.  Results are written in the order of the
+ * sorted image paths regardless of which worker completes first.
+ */
+struct image_batch {
+    std::vector<std::string> paths;
+    std::vector<std::string> lines;
+    std::vector<uint8_t>     ready;
+    std::atomic<size_t>      next{0};
+    std::mutex               lock;
+    size_t                   written = 0;
+    size_t                   errors  = 0;
+    int                      jobs    = 2;
+    FILE*                    output  = NULL;
+};
+
+static bool
+image_extension(const char* name)
+{
+    const char* ext = strrchr(name, '.');
+    if (!ext) { return false; }
+    return !strcasecmp(ext, ".jpg") || !strcasecmp(ext, ".jpeg") ||
+           !strcasecmp(ext, ".png");
+}
+
+/**
+ * Collects the image paths under dir recursively.
+ */
+static int
+image_list(std::vector<std::string>& paths, const std::string& dir)
+{
+    DIR* d = opendir(dir.c_str());
+    if (!d) {
+        fprintf(stderr,
+                "failed to open directory %s: %s\n",
+                dir.c_str(),
+                strerror(errno));
+        return -1;
+    }
+
+    while (struct dirent* entry = readdir(d)) {
+        if (entry->d_name[0] == '.') { continue; }
+
+        std::string path = dir + "/" + entry->d_name;
+        struct stat st;
+        if (stat(path.c_str(), &st)) { continue; }
+
+        if (S_ISDIR(st.st_mode)) {
+            image_list(paths, path);
+        } else if (S_ISREG(st.st_mode) && image_extension(entry->d_name)) {
+            paths.push_back(path);
+        }
+    }
+
+    closedir(d);
+    return 0;
+}
+
+/**
+ * Asks the kernel to start reading the image into the page cache so it is
+ * ready by the time a worker decodes it.
+ */
+static void
+image_prefetch(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) { return; }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+    close(fd);
+}
+
+/**
+ * Stores the result line of image index and writes every result which is now
+ * next in order.
+ */
+static int
+image_write(image_batch& batch, size_t index, std::string&& line)
+{
+    std::lock_guard<std::mutex> guard(batch.lock);
+
+    batch.lines[index] = std::move(line);
+    batch.ready[index] = 1;
+
+    while (batch.written < batch.paths.size() && batch.ready[batch.written]) {
+        auto& out = batch.lines[batch.written];
+        if (!out.empty() &&
+            fwrite(out.data(), 1, out.size(), batch.output) != out.size()) {
+            fprintf(stderr, "failed to write results: %s\n", strerror(errno));
+            return -1;
+        }
+        out.clear();
+        out.shrink_to_fit();
+        batch.written++;
+    }
+
+    return 0;
+}
+
+static void
+image_worker(image_batch& batch, pipeline& pipe)
+{
+    while (running) {
+        size_t index = batch.next.fetch_add(1);
+        if (index >= batch.paths.size()) { break; }
+
+        size_t ahead = index + batch.jobs;
+        if (ahead < batch.paths.size()) { image_prefetch(batch.paths[ahead]); }
+
+        const std::string& path = batch.paths[index];
+
+        data::result result = {
+            .timestamp = vaal_clock_now(),
+            .fps       = 0,
+            .model     = pipe.model,
+        };
+
+        input_frame frame = {
+            .fd        = -1,
+            .memory    = NULL,
+            .path      = path.c_str(),
+            .fourcc    = 0,
+            .width     = 0,
+            .height    = 0,
+            .stride    = 0,
+            .timestamp = result.timestamp,
+            .serial    = (int64_t) index,
+            .source    = NULL,
+            .index     = (int) index,
+            .done      = NULL,
+        };
+
+        /**
+         * An image which fails still gets its line, with an error in place of
+         * the objects, so the lines stay in the order of the images.
+         */
+        json   payload;
+        size_t n_boxes = 0;
+        if (run_detector(pipe, frame, result, n_boxes)) {
+            fprintf(stderr, "failed to process image %s\n", path.c_str());
+            std::lock_guard<std::mutex> guard(batch.lock);
+            batch.errors++;
+            payload = {
+                {"timestamp", result.timestamp},
+                {"error", "failed to process image"},
+            };
+        } else {
+            if (pipe.filter) {
+                n_boxes =
+                    filter_apply(*pipe.filter, pipe.boxes.data(), n_boxes);
+            }
+            payload = result_payload(pipe, result, n_boxes);
+        }
+
+        payload["image"] = path;
+        auto line        = payload.dump();
+        line.push_back('\n');
+
+        if (image_write(batch, index, std::move(line))) {
+            running = 0;
+            break;
+        }
+    }
+}
+
+/**
+ * Runs each pipeline on its own thread over the images of the batch, the first
+ * pipeline is run on the calling thread.
+ */
+static int
+image_run(image_batch& batch, std::vector<pipeline>& pipes)
+{
+    batch.lines.resize(batch.paths.size());
+    batch.ready.assign(batch.paths.size(), 0);
+
+    for (size_t i = 0; i < batch.paths.size() && i < pipes.size(); i++) {
+        image_prefetch(batch.paths[i]);
+    }
+
+    int64_t start = vaal_clock_now();
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < pipes.size(); i++) {
+        threads.emplace_back(image_worker, std::ref(batch), std::ref(pipes[i]));
+    }
+    image_worker(batch, pipes[0]);
+    for (auto& thread : threads) { thread.join(); }
+
+    fflush(batch.output);
+
+    if (verbose) {
+        double seconds = (vaal_clock_now() - start) / double(NSEC_PER_SEC);
+        fprintf(stderr,
+                "processed %zu images in %.2fs (%.1f images/s) with %zu "
+                "errors\n",
+                batch.written,
+                seconds,
+                seconds > 0 ? batch.written / seconds : 0.0,
+                batch.errors);
+    }
+
+    return batch.written == batch.paths.size() ? 0 : -1;
+}
+
+/**
+ * The replay mode publishes recorded results, either an archive directory or
+ * a JSON lines file written with --output, through the same serialization and
+ * publisher as live results.  Results keep their original spacing divided by
+ * speed, or are sent as fast as possible when speed is 0, which load tests the
+ * subscribers and measures the publish path without a camera or model.
+ */
+struct replay {
+    const char* path    = NULL;
+    double      speed   = 1.0;
+    int64_t     count   = 0;
+    int64_t     send_ns = 0;
+};
+
+/**
+ * Calls fn with every result of the JSON lines file between from and to, the
+ * results are passed on as recorded so they keep the fields of the stages
+ * which were enabled.
+ */
+static int
+replay_lines(const char*               path,
+             int64_t                   from,
+             int64_t                   to,
+             std::function<int(json&)> fn)
+{
+    std::ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    std::string line;
+    for (size_t number = 1; std::getline(file, line); number++) {
+        if (line.empty()) { continue; }
+
+        json    payload;
+        int64_t timestamp = 0;
+        try {
+            payload   = json::parse(line);
+            timestamp = payload.at("timestamp").get<int64_t>();
+        } catch (const json::exception& err) {
+            fprintf(stderr, "%s:%zu: %s\n", path, number, err.what());
+            return -1;
+        }
+
+        if (timestamp < from) { continue; }
+        if (timestamp > to) { break; }
+
+        int err = fn(payload);
+        if (err) { return err > 0 ? 0 : err; }
+    }
+
+    return 0;
+}
+
+/**
+ * Waits until a subscriber of topic joins the replay's XPUB socket, so the
+ * first results are not published before anyone receives them.  Returns -1
+ * when the application stops first.
+ */
+static int
+replay_join(zmq::socket_t& pub, const std::string& topic)
+{
+    pub.set(zmq::sockopt::rcvtimeo, 100);
+
+    while (running) {
+        zmq::message_t message;
+        try {
+            if (!pub.recv(message)) { continue; }
+        } catch (const zmq::error_t& err) {
+            if (err.num() == EINTR) { continue; }
+            fprintf(stderr, "failed to wait for subscribers: %s\n", err.what());
+            return -1;
+        }
+
+        const char* data = message.data<char>();
+        if (message.size() < 1 || data[0] != 1) { continue; }
+
+        std::string prefix(data + 1, message.size() - 1);
+        if (!topic.compare(0, prefix.size(), prefix)) { return 0; }
+    }
+
+    return -1;
+}
+
+static int
+replay_run(zmq::socket_t&     pub,
+           const std::string& topic,
+           replay&            rp,
+           int64_t            from,
+           int64_t            to)
+{
+    int64_t start = 0;
+    int64_t first = 0;
+
+    auto send = [&](json& payload) {
+        if (!running) { return 1; }
+
+        int64_t timestamp = payload["timestamp"].get<int64_t>();
+        if (!rp.count) {
+            start = vaal_clock_now();
+            first = timestamp;
+        }
+
+        if (rp.speed > 0) {
+            int64_t elapsed = int64_t((timestamp - first) / rp.speed);
+            int64_t wait    = start + elapsed - vaal_clock_now();
+            if (wait > 0) {
+                struct timespec ts = {
+                    .tv_sec  = time_t(wait / NSEC_PER_SEC),
+                    .tv_nsec = long(wait % NSEC_PER_SEC),
+                };
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        int64_t now = vaal_clock_now();
+        int     err = result_send(pub, topic, NULL, payload);
+        rp.send_ns += vaal_clock_now() - now;
+        rp.count++;
+        return err;
+    };
+
+    struct stat st;
+    if (!stat(rp.path, &st) && S_ISDIR(st.st_mode)) {
+        return archive_read(rp.path, from, to, send);
+    }
+    return replay_lines(rp.path, from, to, send);
+}
+
+/**
+ * The NPU driver compiles the model graph on the first inference which takes
+ * several seconds on the i.MX 8M Plus.  The Vivante OpenVX driver can store the
+ * compiled graphs and reuse them on the next start when the
+ * VIV_VX_ENABLE_CACHE_GRAPH_BINARY and VIV_VX_CACHE_BINARY_GRAPH_DIR variables
+ * are set before the driver is initialized.  The cache directory is keyed by a
+ * hash of the identity of the model files, their device, inode, size and
+ * modification time, along with the engine and the library and driver versions
+ * so a graph compiled for another model or driver is never loaded.  The files
+ * are only stat'ed so the key costs nothing even for large models.
+ */
+static uint64_t
+cache_hash(uint64_t hash, const void* data, size_t size)
+{
+    const uint8_t* bytes = (const uint8_t*) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static int
+cache_hash_file(uint64_t& hash, const char* path)
+{
+    struct stat st;
+    if (stat(path, &st)) { return -1; }
+
+    uint64_t id[5] = {
+        uint64_t(st.st_dev),
+        uint64_t(st.st_ino),
+        uint64_t(st.st_size),
+        uint64_t(st.st_mtim.tv_sec),
+        uint64_t(st.st_mtim.tv_nsec),
+    };
+    hash = cache_hash(hash, id, sizeof(id));
+    return 0;
+}
+
+static int
+cache_mkdir(const std::string& path)
+{
+    for (size_t pos = 1; pos != std::string::npos;) {
+        pos             = path.find('/', pos + 1);
+        std::string dir = path.substr(0, pos);
+        if (mkdir(dir.c_str(), 0755) && errno != EEXIST) { return -1; }
+    }
+    return 0;
+}
+
+/**
+ * Points the driver's graph cache at the directory for these models under
+ * root.  Variables already set in the environment are left untouched.  This
+ * runs once, on the main thread before any context is created, as the driver
+ * only reads the variables when it initializes; models swapped in later are
+ * not part of the key.
+ */
+static int
+cache_setup(const char*                     root,
+            const char*                     engine,
+            const std::vector<const char*>& models)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    for (auto model : models) {
+        if (cache_hash_file(hash, model)) {
+            fprintf(stderr,
+                    "failed to read %s for the graph cache: %s\n",
+                    model,
+                    strerror(errno));
+            return -1;
+        }
+    }
+
+    const char* version = vaal_version(NULL, NULL, NULL, NULL);
+    hash = cache_hash(hash, engine, strlen(engine));
+    if (version) { hash = cache_hash(hash, version, strlen(version)); }
+
+    char          driver[64] = {0};
+    std::ifstream galcore("/sys/module/galcore/version");
+    if (galcore.read(driver, sizeof(driver) - 1) || galcore.gcount()) {
+        hash = cache_hash(hash, driver, strlen(driver));
+    }
+
+    char key[17];
+    snprintf(key, sizeof(key), "%016llx", (unsigned long long) hash);
+    std::string dir = std::string(root) + "/" + key;
+
+    if (cache_mkdir(dir)) {
+        fprintf(stderr,
+                "failed to create graph cache %s: %s\n",
+                dir.c_str(),
+                strerror(errno));
+        return -1;
+    }
+
+    setenv("VIV_VX_ENABLE_CACHE_GRAPH_BINARY", "1", 0);
+    setenv("VIV_VX_CACHE_BINARY_GRAPH_DIR", dir.c_str(), 0);
+
+    if (verbose) {
+        printf("graph cache %s\n", getenv("VIV_VX_CACHE_BINARY_GRAPH_DIR"));
+    }
+
+    return 0;
+}
+
+/**
+ * Records the duration of each startup phase, reported with --verbose.
+ */
+struct startup {
+    int64_t                                      start = vaal_clock_now();
+    int64_t                                      last  = start;
+    std::vector<std::pair<const char*, int64_t>> phases;
+};
+
+static void
+startup_phase(startup& st, const char* name)
+{
+    int64_t now = vaal_clock_now();
+    st.phases.push_back({name, now - st.last});
+    st.last = now;
+}
+
+static void
+startup_report(const startup& st, const char* name)
+{
+    for (auto& phase : st.phases) {
+        printf("startup %-6s %-12s %8.1fms\n",
+               name,
+               phase.first,
+               phase.second / 1e6);
+    }
+    printf("startup %-6s %-12s %8.1fms\n",
+           name,
+           "total",
+           (st.last - st.start) / 1e6);
+}
+
+int
+main(int argc, char** argv)
+{
+    int         err;
+    int         max_boxes  = 50;
+    float       threshold  = 0.5f;
+    float       iou        = 0.5f;
+    const char* engine     = "npu";
+    const char* vslpath    = "/tmp/camera.vsl";
+    const char* puburl     = "ipc:///tmp/detect.pub";
+    const char* ctlurl     = NULL;
+    const char* lasturl    = NULL;
+    std::string topic      = "DETECTION";
+    std::string capture    = "";
+    std::string labeltopic = "LABELS";
+    int         label_ids  = 0;
+    const char* nms        = "standard";
+    const char* filterpath = NULL;
+    const char* zonepath   = NULL;
+    const char* linepath   = NULL;
+    int         tracking   = 0;
+    int         frame_skip = 0;
+    int         watch      = 0;
+    int         warmup     = 2;
+    const char* cachedir   = NULL;
+    const char* dumpdir    = NULL;
+    int64_t     from       = 0;
+    int64_t     to         = std::numeric_limits<int64_t>::max();
+    replay      rp;
+
+    native::decoder decoder;
+    zone_set        zones;
+    tracker         tracks;
+    line_set        lines;
+    publish_policy  policy;
+    result_history  history;
+    result_archive  archive;
+    frame_cache     held;
+    snapshot_pool   snapshots;
+    ensemble        fusion;
+    cascade         classify;
+    gatekeeper      gate;
+    v4l2_capture    camera;
+    raw_input       raw;
+    vsl_capture     grabber;
+    result_ring     ring;
+    stream_info     stream;
+
+    std::vector<const char*> ensemble_models;
+    const char*              classifier = NULL;
+    const char*              classlist  = NULL;
+    const char*              snapshot   = NULL;
+    const char*              gatemodel  = NULL;
+    const char*              gatelist   = NULL;
+    const char*              v4l2dev    = NULL;
+    const char*              outpath    = NULL;
+    const char*              imagedir   = NULL;
+    int                      jobs       = 2;
+    FILE*                    output     = NULL;
+
+    enum {
+        OPT_TILES = 256,
+        OPT_TILE_OVERLAP,
+        OPT_WBF_IOU,
+        OPT_CLASSIFY,
+        OPT_CLASSIFY_MAX,
+        OPT_CROP_MARGIN,
+        OPT_GATE_CLASSES,
+        OPT_GATE_THRESHOLD,
+        OPT_GATE_LOW,
+        OPT_GATE_HOLD,
+        OPT_V4L2,
+        OPT_V4L2_SIZE,
+        OPT_V4L2_FORMAT,
+        OPT_V4L2_BUFFERS,
+        OPT_INPUT,
+        OPT_SIZE,
+        OPT_FORMAT,
+        OPT_INPUT_FPS,
+        OPT_OUTPUT,
+        OPT_IMAGES,
+        OPT_JOBS,
+        OPT_VSL_STALL,
+        OPT_VSL_BUFFERS,
+        OPT_CONNECTION_TOPIC,
+        OPT_CONTROL,
+        OPT_FRAME_SKIP,
+        OPT_WATCH,
+        OPT_WARMUP,
+        OPT_CACHE,
+        OPT_BENCHMARK_STARTUP,
+        OPT_RING,
+        OPT_RING_SIZE,
+        OPT_LABEL_IDS,
+        OPT_LABEL_TOPIC,
+        OPT_STREAM_TOPIC,
+        OPT_PUBLISH_POLICY,
+        OPT_CHANGE_IOU,
+        OPT_CHANGE_SCORE,
+        OPT_KEYFRAME,
+        OPT_LAST_VALUE,
+        OPT_HISTORY,
+        OPT_ARCHIVE,
+        OPT_ARCHIVE_SEGMENT,
+        OPT_ARCHIVE_LIMIT,
+        OPT_ARCHIVE_FLUSH,
+        OPT_DUMP_ARCHIVE,
+        OPT_FROM,
+        OPT_TO,
+        OPT_REPLAY,
+        OPT_REPLAY_SPEED,
+        OPT_HOLD_FRAMES,
+        OPT_SNAPSHOT,
+        OPT_SNAPSHOT_ZONES,
+        OPT_SNAPSHOT_CROP,
+        OPT_SNAPSHOT_TOPIC,
+        OPT_SNAPSHOT_QUALITY,
+        OPT_SNAPSHOT_JOBS,
+    };
+
+    struct option options[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"version", no_argument, NULL, 'V'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"engine", required_argument, NULL, 'e'},
+        {"vsl", required_argument, NULL, 's'},
+        {"pub", required_argument, NULL, 'p'},
+        {"topic", required_argument, NULL, 't'},
+        {"capture-topic", required_argument, NULL, 'c'},
+        {"max-boxes", required_argument, NULL, 'm'},
+        {"threshold", required_argument, NULL, 'T'},
+        {"iou", required_argument, NULL, 'I'},
+        {"nms", required_argument, NULL, 'n'},
+        {"native", no_argument, NULL, 'N'},
+        {"top-k", required_argument, NULL, 'k'},
+        {"benchmark-nms", no_argument, NULL, 'B'},
+        {"filter", required_argument, NULL, 'f'},
+        {"zones", required_argument, NULL, 'z'},
+        {"zone-topic", required_argument, NULL, 'Z'},
+        {"track", no_argument, NULL, 'r'},
+        {"lines", required_argument, NULL, 'l'},
+        {"line-topic", required_argument, NULL, 'L'},
+        {"ensemble", required_argument, NULL, 'E'},
+        {"tiles", required_argument, NULL, OPT_TILES},
+        {"tile-overlap", required_argument, NULL, OPT_TILE_OVERLAP},
+        {"wbf-iou", required_argument, NULL, OPT_WBF_IOU},
+        {"classifier", required_argument, NULL, 'C'},
+        {"classify", required_argument, NULL, OPT_CLASSIFY},
+        {"classify-max", required_argument, NULL, OPT_CLASSIFY_MAX},
+        {"crop-margin", required_argument, NULL, OPT_CROP_MARGIN},
+        {"gate", required_argument, NULL, 'G'},
+        {"gate-classes", required_argument, NULL, OPT_GATE_CLASSES},
+        {"gate-threshold", required_argument, NULL, OPT_GATE_THRESHOLD},
+        {"gate-low", required_argument, NULL, OPT_GATE_LOW},
+        {"gate-hold", required_argument, NULL, OPT_GATE_HOLD},
+        {"v4l2", required_argument, NULL, OPT_V4L2},
+        {"v4l2-size", required_argument, NULL, OPT_V4L2_SIZE},
+        {"v4l2-format", required_argument, NULL, OPT_V4L2_FORMAT},
+        {"v4l2-buffers", required_argument, NULL, OPT_V4L2_BUFFERS},
+        {"input", required_argument, NULL, OPT_INPUT},
+        {"size", required_argument, NULL, OPT_SIZE},
+        {"format", required_argument, NULL, OPT_FORMAT},
+        {"input-fps", required_argument, NULL, OPT_INPUT_FPS},
+        {"output", required_argument, NULL, OPT_OUTPUT},
+        {"images", required_argument, NULL, OPT_IMAGES},
+        {"jobs", required_argument, NULL, OPT_JOBS},
+        {"vsl-stall", required_argument, NULL, OPT_VSL_STALL},
+        {"vsl-buffers", required_argument, NULL, OPT_VSL_BUFFERS},
+        {"connection-topic", required_argument, NULL, OPT_CONNECTION_TOPIC},
+        {"control", required_argument, NULL, OPT_CONTROL},
+        {"frame-skip", required_argument, NULL, OPT_FRAME_SKIP},
+        {"watch", no_argument, NULL, OPT_WATCH},
+        {"warmup", required_argument, NULL, OPT_WARMUP},
+        {"cache", required_argument, NULL, OPT_CACHE},
+        {"benchmark-startup", no_argument, NULL, OPT_BENCHMARK_STARTUP},
+        {"ring", required_argument, NULL, OPT_RING},
+        {"ring-size", required_argument, NULL, OPT_RING_SIZE},
+        {"label-ids", no_argument, NULL, OPT_LABEL_IDS},
+        {"label-topic", required_argument, NULL, OPT_LABEL_TOPIC},
+        {"stream-topic", required_argument, NULL, OPT_STREAM_TOPIC},
+        {"publish-policy", required_argument, NULL, OPT_PUBLISH_POLICY},
+        {"change-iou", required_argument, NULL, OPT_CHANGE_IOU},
+        {"change-score", required_argument, NULL, OPT_CHANGE_SCORE},
+        {"keyframe", required_argument, NULL, OPT_KEYFRAME},
+        {"last-value", required_argument, NULL, OPT_LAST_VALUE},
+        {"history", required_argument, NULL, OPT_HISTORY},
+        {"archive", required_argument, NULL, OPT_ARCHIVE},
+        {"archive-segment", required_argument, NULL, OPT_ARCHIVE_SEGMENT},
+        {"archive-limit", required_argument, NULL, OPT_ARCHIVE_LIMIT},
+        {"archive-flush", required_argument, NULL, OPT_ARCHIVE_FLUSH},
+        {"dump-archive", required_argument, NULL, OPT_DUMP_ARCHIVE},
+        {"from", required_argument, NULL, OPT_FROM},
+        {"to", required_argument, NULL, OPT_TO},
+        {"replay", required_argument, NULL, OPT_REPLAY},
+        {"replay-speed", required_argument, NULL, OPT_REPLAY_SPEED},
+        {"hold-frames", required_argument, NULL, OPT_HOLD_FRAMES},
+        {"snapshot", required_argument, NULL, OPT_SNAPSHOT},
+        {"snapshot-zones", no_argument, NULL, OPT_SNAPSHOT_ZONES},
+        {"snapshot-crop", no_argument, NULL, OPT_SNAPSHOT_CROP},
+        {"snapshot-topic", required_argument, NULL, OPT_SNAPSHOT_TOPIC},
+        {"snapshot-quality", required_argument, NULL, OPT_SNAPSHOT_QUALITY},
+        {"snapshot-jobs", required_argument, NULL, OPT_SNAPSHOT_JOBS},
+        {NULL},
+    };
+
+    for (;;) {
+        int opt = getopt_long(argc,
+                              argv,
+                              "hVve:m:s:p:t:c:T:I:n:Nk:Bf:z:Z:rl:L:E:C:G:",
+                              options,
+                              NULL);
+        if (opt == -1) break;
+
+        switch (opt) {
+        case 'h':
+            printf("detect [OPTIONS] MODEL\n"
+                   "-h, --help\n"
+                   "    display help information\n"
+                   "-V, --version\n"
+                   "    display version information\n"
+                   "-v, --verbose\n"
+                   "   enable verbose logging of each message\n"
+                   "-m MAX --max-boxes MAX\n"
+                   "    maximum detection boxes per frame (default: %d)\n"
+                   "-T THRESHOLD, --threshold THRESHOLD\n"
+                   "    set the detection threshold (default: %.2f)\n"
+                   "-f FILE, --filter FILE\n"
+                   "    per-class thresholds and allow/deny lists (json)\n"
+                   "-I IOU, --iou IOU\n"
+                   "    set the detection iou for nms (default: %.02f)\n"
+                   "-n NMS, --nms NMS\n"
+                   "    nms variant [standard*, class, soft, diou, matrix]\n"
+                   "    variants other than standard use native decoding\n"
+                   "-N, --native\n"
+                   "    decode model outputs natively instead of vaal_boxes\n"
+                   "-k K, --top-k K\n"
+                   "    candidates kept for nms, 0 for all (default: %zu)\n"
+                   "-E MODEL, --ensemble MODEL\n"
+                   "    add MODEL to the ensemble fused by WBF (repeatable)\n"
+                   "--tiles COLSxROWS\n"
+                   "    add tiles of the frame to the ensemble run by MODEL\n"
+                   "--tile-overlap FRACTION\n"
+                   "    overlap between neighbouring tiles (default: %.2f)\n"
+                   "--wbf-iou IOU\n"
+                   "    iou to fuse boxes of the ensemble (default: %.2f)\n"
+                   "-C MODEL, --classifier MODEL\n"
+                   "    classify crops of the detected boxes with MODEL\n"
+                   "--classify LABELS\n"
+                   "    comma separated detection labels to classify (all)\n"
+                   "--classify-max N\n"
+                   "    maximum crops classified per frame (default: %zu)\n"
+                   "--crop-margin FRACTION\n"
+                   "    margin added around the boxes to crop (default: %.2f)\n"
+                   "-G MODEL, --gate MODEL\n"
+                   "    only run the full model when MODEL detects a class\n"
+                   "--gate-classes LABELS\n"
+                   "    comma separated gate model labels which open the gate\n"
+                   "--gate-threshold THRESHOLD\n"
+                   "    score which opens the gate (default: %.2f)\n"
+                   "--gate-low THRESHOLD\n"
+                   "    score which keeps the gate open (default: %.2f)\n"
+                   "--gate-hold FRAMES\n"
+                   "    frames the gate stays open after (default: %d)\n"
+                   "-B, --benchmark-nms\n"
+                   "    compare vaal_boxes and native decoding timings\n"
+                   "--benchmark-startup\n"
+                   "    report startup phases and exit after the first result\n"
+                   "-e ENGINE, --engine ENGINE\n"
+                   "    select the inference engine device [cpu, gpu, npu*]\n"
+                   "--cache DIR\n"
+                   "    cache the npu compiled graphs under DIR\n"
+                   "--warmup N\n"
+                   "    inferences run before publishing (default: %d)\n"
+                   "-s PATH, --vsl PATH\n"
+                   "    vsl socket path to capture frames (default: %s)\n"
+                   "--vsl-stall SECONDS\n"
+                   "    reconnect after SECONDS of no frames (default: %.1f)\n"
+                   "--vsl-buffers N\n"
+                   "    buffers in the vsl host's pool (default: %zu)\n"
+                   "--connection-topic TOPIC\n"
+                   "    publish vsl connection events (default: '%s')\n"
+                   "--v4l2 DEVICE\n"
+                   "    capture frames directly from the v4l2 DEVICE\n"
+                   "--v4l2-size WIDTHxHEIGHT\n"
+                   "    set the v4l2 capture size (default: device)\n"
+                   "--v4l2-format FOURCC\n"
+                   "    set the v4l2 capture format (default: device)\n"
+                   "--v4l2-buffers N\n"
+                   "    number of v4l2 buffers queued (default: %d)\n"
+                   "--input FILE\n"
+                   "    process the raw frames of FILE as fast as possible\n"
+                   "--size WIDTHxHEIGHT\n"
+                   "    size of the raw input frames\n"
+                   "--format FOURCC\n"
+                   "    format of the raw input frames (default: NV12)\n"
+                   "--input-fps FPS\n"
+                   "    timestamp raw input frames at FPS (default: clock)\n"
+                   "--output FILE\n"
+                   "    write results to FILE as json lines, - for stdout\n"
+                   "--images DIR\n"
+                   "    process the jpeg and png images under DIR then exit\n"
+                   "--jobs N\n"
+                   "    number of models processing images (default: %d)\n"
+                   "-p URL, --pub URL\n"
+                   "    url for the result message queue (default: %s)\n"
+                   "--last-value URL\n"
+                   "    serve the last message of every topic on URL\n"
+                   "--ring NAME\n"
+                   "    also write results to the shared memory ring NAME\n"
+                   "--ring-size N\n"
+                   "    number of records in the ring (default: %u)\n"
+                   "--archive DIR\n"
+                   "    record compressed results into segments under DIR\n"
+                   "--archive-segment MB\n"
+                   "    size of the archive segments (default: %lld)\n"
+                   "--archive-limit MB\n"
+                   "    remove the oldest segments above MB (default: %lld)\n"
+                   "--archive-flush SECONDS\n"
+                   "    write partial blocks every SECONDS (default: %lld)\n"
+                   "--dump-archive DIR\n"
+                   "    write the results archived under DIR as json lines\n"
+                   "--from TIMESTAMP, --to TIMESTAMP\n"
+                   "    range of the archived results to dump or replay\n"
+                   "--replay PATH\n"
+                   "    publish the results of an archive or json lines file\n"
+                   "--replay-speed SPEED\n"
+                   "    replay speed factor, 0 for no delay (default: %.1f)\n"
+                   "--control URL\n"
+                   "    url for the json control channel (default: none)\n"
+                   "--history SECONDS\n"
+                   "    keep SECONDS of results for control history queries\n"
+                   "--hold-frames N\n"
+                   "    hold the last N vsl frames for control crop requests\n"
+                   "--frame-skip N\n"
+                   "    skip N frames after each processed frame\n"
+                   "--watch\n"
+                   "    swap to the new model when the model file changes\n"
+                   "-t TOPIC, --topic TOPIC\n"
+                   "    subscribe to publisher topic (default: '%s')\n"
+                   "--publish-policy POLICY\n"
+                   "    publish results [all*, changes]\n"
+                   "--change-iou IOU\n"
+                   "    iou under which a box has changed (default: %.2f)\n"
+                   "--change-score DELTA\n"
+                   "    score change of a changed box (default: %.2f)\n"
+                   "--keyframe MS\n"
+                   "    publish unchanged results every MS (default: %lld)\n"
+                   "-c TOPIC, --capture TOPIC\n"
+                   "    publish capture event to TOPIC when frame is loaded\n"
+                   "--label-ids\n"
+                   "    publish label indices instead of the label text\n"
+                   "--label-topic TOPIC\n"
+                   "    publish the label table to TOPIC (default: '%s')\n"
+                   "--stream-topic TOPIC\n"
+                   "    publish the stream config to TOPIC (default: '%s')\n"
+                   "-z FILE, --zones FILE\n"
+                   "    polygon zones for occupancy events (json)\n"
+                   "-Z TOPIC, --zone-topic TOPIC\n"
+                   "    publish zone events to TOPIC (default: '%s')\n"
+                   "-r, --track\n"
+                   "    assign track identities to the detected objects\n"
+                   "-l FILE, --lines FILE\n"
+                   "    line-crossing counters on tracked objects (json)\n"
+                   "-L TOPIC, --line-topic TOPIC\n"
+                   "    publish line events to TOPIC (default: '%s')\n"
+                   "--snapshot LABELS\n"
+                   "    jpeg snapshot of vsl frames where the labels appear\n"
+                   "--snapshot-zones\n"
+                   "    also snapshot the frames with zone events\n"
+                   "--snapshot-crop\n"
+                   "    snapshot the appearing object instead of the frame\n"
+                   "--snapshot-topic TOPIC\n"
+                   "    publish snapshots to TOPIC (default: '%s')\n"
+                   "--snapshot-quality QUALITY\n"
+                   "    jpeg quality of the snapshots (default: %d)\n"
+                   "--snapshot-jobs N\n"
+                   "    number of snapshot encoder threads (default: %zu)\n",
+                   max_boxes,
+                   threshold,
+                   iou,
+                   decoder.top_k,
+                   fusion.tile_overlap,
+                   fusion.iou_threshold,
+                   classify.max_crops,
+                   classify.margin,
+                   gate.threshold,
+                   gate.low,
+                   gate.hold,
+                   warmup,
+                   vslpath,
+                   grabber.stall / double(NSEC_PER_SEC),
+                   grabber.buffers,
+                   grabber.topic.c_str(),
+                   camera.buffers,
+                   jobs,
+                   puburl,
+                   ring.capacity,
+                   (long long) (archive.segment_size >> 20),
+                   (long long) (archive.limit >> 20),
+                   (long long) (archive.flush / NSEC_PER_SEC),
+                   rp.speed,
+                   topic.c_str(),
+                   policy.min_iou,
+                   policy.max_score,
+                   (long long) (policy.keyframe / 1000000),
+                   labeltopic.c_str(),
+                   stream.topic.c_str(),
+                   zones.topic.c_str(),
+                   lines.topic.c_str(),
+                   snapshots.topic.c_str(),
+                   snapshots.quality,
+                   snapshots.jobs);
+            return EXIT_SUCCESS;
+        case 'V':
+            printf("detect %s\n", VERSION);
+            return EXIT_SUCCESS;
+        case 'v':
+            verbose = 1;
+            break;
+        case 'e':
+            engine = optarg;
+            break;
+        case 'm':
+            max_boxes = atoi(optarg);
+            break;
+        case 'T':
+            threshold = atof(optarg);
+            break;
+        case 'I':
+            iou = atof(optarg);
+            break;
+        case 'n':
+            if (native::parse_nms(optarg, decoder.type)) {
+                fprintf(stderr, "invalid nms type %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            nms = optarg;
+            if (decoder.type != native::nms::standard) {
+                decoder.enabled = true;
+            }
+            break;
+        case 'N':
+            decoder.enabled = true;
+            break;
+        case 'k':
+            decoder.top_k = strtoul(optarg, NULL, 10);
+            break;
+        case 'B':
+            benchmark_nms = 1;
+            break;
+        case 'f':
+            filterpath = optarg;
+            break;
+        case 'z':
+            zonepath = optarg;
+            break;
+        case 'Z':
+            zones.topic = optarg;
+            break;
+        case 'r':
+            tracking = 1;
+            break;
+        case 'l':
+            linepath = optarg;
+            tracking = 1;
+            break;
+        case 'L':
+            lines.topic = optarg;
+            break;
+        case 'E':
+            ensemble_models.push_back(optarg);
+            break;
+        case OPT_TILES:
+            if (ensemble_parse_tiles(fusion, optarg)) {
+                fprintf(stderr, "invalid tiles %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_TILE_OVERLAP:
+            fusion.tile_overlap = atof(optarg);
+            break;
+        case OPT_WBF_IOU:
+            fusion.iou_threshold = atof(optarg);
+            break;
+        case 'C':
+            classifier = optarg;
+            break;
+        case OPT_CLASSIFY:
+            classlist = optarg;
+            break;
+        case OPT_CLASSIFY_MAX:
+            classify.max_crops = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_CROP_MARGIN:
+            classify.margin = atof(optarg);
+            break;
+        case 'G':
+            gatemodel = optarg;
+            break;
+        case OPT_GATE_CLASSES:
+            gatelist = optarg;
+            break;
+        case OPT_GATE_THRESHOLD:
+            gate.threshold = atof(optarg);
+            break;
+        case OPT_GATE_LOW:
+            gate.low = atof(optarg);
+            break;
+        case OPT_GATE_HOLD:
+            gate.hold = atoi(optarg);
+            break;
+        case OPT_V4L2:
+            v4l2dev = optarg;
+            break;
+        case OPT_V4L2_SIZE:
+            if (v4l2_parse_size(camera, optarg)) {
+                fprintf(stderr, "invalid v4l2 size %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_V4L2_FORMAT:
+            if (v4l2_parse_format(camera, optarg)) {
+                fprintf(stderr, "invalid v4l2 format %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_V4L2_BUFFERS:
+            camera.buffers = atoi(optarg);
+            if (camera.buffers < 2) {
+                fprintf(stderr, "at least 2 v4l2 buffers are required\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_INPUT:
+            raw.path = optarg;
+            break;
+        case OPT_SIZE:
+            if (sscanf(optarg, "%dx%d", &raw.width, &raw.height) != 2 ||
+                raw.width <= 0 || raw.height <= 0) {
+                fprintf(stderr, "invalid size %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_FORMAT:
+            if (strlen(optarg) != 4) {
+                fprintf(stderr, "invalid format %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            raw.fourcc =
+                v4l2_fourcc(optarg[0], optarg[1], optarg[2], optarg[3]);
+            break;
+        case OPT_INPUT_FPS:
+            raw.fps = atof(optarg);
+            break;
+        case OPT_OUTPUT:
+            outpath = optarg;
+            break;
+        case OPT_IMAGES:
+            imagedir = optarg;
+            break;
+        case OPT_VSL_STALL:
+            grabber.stall = int64_t(atof(optarg) * NSEC_PER_SEC);
+            break;
+        case OPT_VSL_BUFFERS:
+            grabber.buffers = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_CONNECTION_TOPIC:
+            grabber.topic = optarg;
+            break;
+        case OPT_CONTROL:
+            ctlurl = optarg;
+            break;
+        case OPT_WARMUP:
+            warmup = atoi(optarg);
+            break;
+        case OPT_CACHE:
+            cachedir = optarg;
+            break;
+        case OPT_RING:
+            ring.name = optarg;
+            break;
+        case OPT_RING_SIZE:
+            ring.capacity = strtoul(optarg, NULL, 10);
+            if (ring.capacity < 2) {
+                fprintf(stderr, "invalid ring size %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_LABEL_IDS:
+            label_ids = 1;
+            break;
+        case OPT_LABEL_TOPIC:
+            labeltopic = optarg;
+            break;
+        case OPT_STREAM_TOPIC:
+            stream.topic = optarg;
+            break;
+        case OPT_PUBLISH_POLICY:
+            if (publish_parse(policy, optarg)) {
+                fprintf(stderr, "invalid publish policy %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_CHANGE_IOU:
+            policy.min_iou = atof(optarg);
+            break;
+        case OPT_CHANGE_SCORE:
+            policy.max_score = atof(optarg);
+            break;
+        case OPT_KEYFRAME:
+            policy.keyframe = atoll(optarg) * 1000000;
+            break;
+        case OPT_ARCHIVE:
+            archive.dir = optarg;
+            break;
+        case OPT_ARCHIVE_SEGMENT:
+            archive.segment_size = atoll(optarg) << 20;
+            break;
+        case OPT_ARCHIVE_LIMIT:
+            archive.limit = atoll(optarg) << 20;
+            break;
+        case OPT_ARCHIVE_FLUSH:
+            archive.flush = int64_t(atof(optarg) * NSEC_PER_SEC);
+            if (archive.flush <= 0) {
+                fprintf(stderr, "invalid archive flush %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_DUMP_ARCHIVE:
+            dumpdir = optarg;
+            break;
+        case OPT_FROM:
+            from = atoll(optarg);
+            break;
+        case OPT_TO:
+            to = atoll(optarg);
+            break;
+        case OPT_REPLAY:
+            rp.path = optarg;
+            break;
+        case OPT_REPLAY_SPEED:
+            rp.speed = atof(optarg);
+            if (rp.speed < 0) {
+                fprintf(stderr, "invalid replay speed %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_HOLD_FRAMES:
+            held.capacity = strtoul(optarg, NULL, 10);
+            break;
+        case OPT_SNAPSHOT:
+            snapshot = optarg;
+            break;
+        case OPT_SNAPSHOT_ZONES:
+            snapshots.zones = true;
+            break;
+        case OPT_SNAPSHOT_CROP:
+            snapshots.crop = true;
+            break;
+        case OPT_SNAPSHOT_TOPIC:
+            snapshots.topic = optarg;
+            break;
+        case OPT_SNAPSHOT_QUALITY:
+            snapshots.quality = atoi(optarg);
+            if (snapshots.quality < 1 || snapshots.quality > 100) {
+                fprintf(stderr, "invalid snapshot quality %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_SNAPSHOT_JOBS:
+            snapshots.jobs = strtoul(optarg, NULL, 10);
+            if (!snapshots.jobs) {
+                fprintf(stderr, "invalid snapshot jobs %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_HISTORY:
+            history.window = int64_t(atof(optarg) * NSEC_PER_SEC);
+            if (history.window <= 0) {
+                fprintf(stderr, "invalid history %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_LAST_VALUE:
+            lasturl    = optarg;
+            last_value = 1;
+            break;
+        case OPT_BENCHMARK_STARTUP:
+            benchmark_startup = 1;
+            break;
+        case OPT_WATCH:
+            watch = 1;
+            break;
+        case OPT_FRAME_SKIP:
+            frame_skip = atoi(optarg);
+            if (frame_skip < 0) {
+                fprintf(stderr, "invalid frame skip %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case OPT_JOBS:
+            jobs = atoi(optarg);
+            if (jobs < 1) {
+                fprintf(stderr, "invalid jobs %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            topic = optarg;
+            break;
+        case 'c':
+            capture = optarg;
+            break;
+        case 's':
+            vslpath = optarg;
+            break;
+        case 'p':
+            puburl = optarg;
+            break;
+        default:
+            fprintf(stderr,
+                    "invalid parameter %c, try --help for usage\n",
+                    opt);
+            return EXIT_FAILURE;
+        }
+    }
+
+    /**
+     * Dumping the archive does not need a model.
+     */
+    if (dumpdir) {
+        FILE* out = outpath && strcmp(outpath, "-") ? fopen(outpath, "w")
+                                                    : stdout;
+        if (!out) {
+            fprintf(stderr,
+                    "failed to open output %s: %s\n",
+                    outpath,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        err = archive_dump(dumpdir, from, to, out);
+        if (out != stdout) { fclose(out); }
+        return err ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    /**
+     * The replay publishes with the same options as the live results, the
+     * socket is an XPUB only so the replay can start once the first subscriber
+     * of the topic has joined.
+     */
+    if (rp.path) {
+        zmq::context_t ctx;
+        zmq::socket_t  pub(ctx, zmq::socket_type::xpub);
+        publish_bind(pub, puburl);
+
+        signal(SIGINT, quit);
+        signal(SIGTERM, quit);
+        if (verbose) { printf("waiting for a subscriber of %s\n", puburl); }
+        if (replay_join(pub, topic)) { return EXIT_FAILURE; }
+
+        err = replay_run(pub, topic, rp, from, to);
+        printf("replayed %lld results, %.1fus per result to publish\n",
+               (long long) rp.count,
+               rp.count ? rp.send_ns / 1e3 / rp.count : 0.0);
+        return err ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (argv[optind] == NULL) {
+        fprintf(stderr, "missing required model, try --help for usage\n");
+        return EXIT_FAILURE;
+    }
+
+    const char* model = argv[optind++];
+
+    /**
+     * Images are independent of each other and processed out of order so the
+     * stages which follow objects across frames or hold their own model
+     * contexts are not supported.
+     */
+    if (imagedir && (ensemble_models.size() || fusion.tile_cols > 0 ||
+                     fusion.tile_rows > 0 || classifier || gatemodel ||
+                     zonepath || tracking || benchmark_nms)) {
+        fprintf(stderr,
+                "--images does not support ensembles, tiles, classifier, "
+                "gate, zones, tracking or --benchmark-nms\n");
+        return EXIT_FAILURE;
+    }
+
+    if ((history.window || held.capacity) && !ctlurl) {
+        fprintf(stderr, "--history and --hold-frames require --control\n");
+        return EXIT_FAILURE;
+    }
+
+    /**
+     * The held frames, the snapshots waiting for and being encoded, the frame
+     * processed and the next one waiting all stay in the videostream host's
+     * pool, which needs one more buffer to keep capturing.
+     */
+    size_t pinned = held.capacity + 2;
+    if (snapshot || snapshots.zones) {
+        pinned += snapshots.queue + snapshots.jobs;
+    }
+    if (!imagedir && !v4l2dev && !raw.path && pinned >= grabber.buffers) {
+        fprintf(stderr,
+                "--hold-frames and snapshots keep up to %zu frames, "
+                "--vsl-buffers %zu must be larger\n",
+                pinned,
+                grabber.buffers);
+        return EXIT_FAILURE;
+    }
+
+    startup timer;
+
+    /**
+     * The graph cache, enabled with --cache, must be configured before the
+     * first context initializes the NPU driver, a failure only costs the
+     * slower startup.
+     */
+    if (cachedir && !strcmp(engine, "npu")) {
+        std::vector<const char*> models = {model};
+        models.insert(models.end(),
+                      ensemble_models.begin(),
+                      ensemble_models.end());
+        if (classifier) { models.push_back(classifier); }
+        if (gatemodel) { models.push_back(gatemodel); }
+        cache_setup(cachedir, engine, models);
+        startup_phase(timer, "cache");
+    }
+
+    /**
+     * The ZeroMQ Context is required for all ZeroMQ API functions.  We create
+     * the context then we create our publisher socket which will be used for
+     * publishing detection results from VAAL.
+     *
+     * Binding the publisher and connecting to the frame source do not depend
+     * on the model so they run on a second thread while the models load and
+     * warm up, the results are joined before the first frame.
+     */
+    zmq::context_t ctx;
+    zmq::socket_t  pub(ctx, zmq::socket_type::pub);
+    startup        iotimer;
+
+    auto connect = [&]() -> int {
+        publish_bind(pub, puburl);
+        startup_phase(iotimer, "publisher");
+
+        if (verbose) {
+            printf("publishing results to [%s]: %s\n",
+                   topic.c_str(),
+                   puburl);
+        }
+
+        /**
+         * The application uses the VideoStream Library for sharing camera
+         * frames between the various applications for this demonstration.  We
+         * initialize the client to connect to vslpath which should be the
+         * end-point into which we inject capture frames using GStreamer and
+         * vslsink or a native vslhost application.
+         */
+        if (raw.path) {
+            if (!raw.width) {
+                fprintf(stderr, "--size is required with --input\n");
+                return -1;
+            }
+            if (raw_open(raw)) { return -1; }
+
+            if (verbose) {
+                printf("processing %zu %dx%d %.4s frames from %s\n",
+                       raw.count,
+                       raw.width,
+                       raw.height,
+                       (const char*) &raw.fourcc,
+                       raw.path);
+            }
+        } else if (v4l2dev) {
+            /**
+             * Alternatively frames are captured directly from a v4l2 device,
+             * the vivid virtual driver can be used for testing without a
+             * camera.
+             */
+            camera.device = v4l2dev;
+            if (v4l2_open(camera)) { return -1; }
+
+            if (verbose) {
+                printf("capturing %dx%d %.4s frames from %s with %zu buffers\n",
+                       camera.width,
+                       camera.height,
+                       (const char*) &camera.fourcc,
+                       v4l2dev,
+                       camera.dmabufs.size());
+            }
+        } else {
+            vsl = vsl_client_init(vslpath, NULL, true);
+            if (!vsl) {
+                fprintf(stderr,
+                        "failed to connect videostream socket %s: %s\n",
+                        vslpath,
+                        strerror(errno));
+                return -1;
+            }
+
+            if (verbose) { printf("capturing frames from %s\n", vslpath); }
+
+            // 100ms timeout on frame capture.
+            vsl_client_set_timeout(vsl, 0.1f);
+        }
+        startup_phase(iotimer, "source");
+        return 0;
+    };
+
+    std::future<int> connected;
+    if (!imagedir) { connected = std::async(std::launch::async, connect); }
 
-    const char* model = argv[optind++];
-
     /**
      * The VAALContext is used for all VAAL operations and one should be created
      * per-model to be executed by the application.
@@ -383,6 +7669,7 @@ main(int argc, char** argv)
         fprintf(stderr, "failed to create vaal context\n");
         return EXIT_FAILURE;
     }
+    startup_phase(timer, "context");
 
     err = vaal_load_model_file(vaal, model);
     if (err) {
@@ -392,65 +7679,495 @@ main(int argc, char** argv)
                 vaal_strerror(VAALError(err)));
         return EXIT_FAILURE;
     }
+    startup_phase(timer, "load");
+
+    /**
+     * With a class filter the model runs at the lowest threshold in the table
+     * and the filter raises it per class after decoding.
+     */
+    class_filter filter;
+    if (filterpath) {
+        if (filter_load(filter, filterpath, vaal, threshold)) {
+            return EXIT_FAILURE;
+        }
+        threshold = filter_minimum(filter);
+    }
+
+    if (zonepath && zone_load(zones, zonepath, vaal)) { return EXIT_FAILURE; }
+    if (linepath && line_load(lines, linepath, vaal)) { return EXIT_FAILURE; }
+
+    /**
+     * Each ensemble model requires its own VAALContext while the tiles are run
+     * by the primary model's context.
+     */
+    for (auto path : ensemble_models) {
+        auto member = vaal_context_create(engine);
+        if (!member) {
+            fprintf(stderr, "failed to create vaal context\n");
+            return EXIT_FAILURE;
+        }
+
+        err = vaal_load_model_file(member, path);
+        if (err) {
+            fprintf(stderr,
+                    "failed to load %s: %s\n",
+                    path,
+                    vaal_strerror(VAALError(err)));
+            return EXIT_FAILURE;
+        }
+
+        vaal_parameter_setf(member, "score_threshold", &threshold, 1);
+        vaal_parameter_setf(member, "iou_threshold", &iou, 1);
+        vaal_parameter_sets(member, "nms_type", "standard", 0);
+        vaal_parameter_seti(member, "max_detection", &max_boxes, 1);
+        fusion.members.push_back({member, -1});
+    }
+
+    for (int tile = 0; tile < fusion.tile_cols * fusion.tile_rows; tile++) {
+        fusion.members.push_back({NULL, tile});
+    }
+
+    /**
+     * Every member returns up to max_detection boxes of its own, whatever the
+     * primary model found, so the scratch holds that many.
+     */
+    fusion.scratch.resize(max_boxes);
+
+    if (classifier) {
+        classify.vaal = vaal_context_create(engine);
+        if (!classify.vaal) {
+            fprintf(stderr, "failed to create vaal context\n");
+            return EXIT_FAILURE;
+        }
+
+        err = vaal_load_model_file(classify.vaal, classifier);
+        if (err) {
+            fprintf(stderr,
+                    "failed to load %s: %s\n",
+                    classifier,
+                    vaal_strerror(VAALError(err)));
+            return EXIT_FAILURE;
+        }
+
+        if (classlist) {
+            label_list(vaal, classlist, "--classify", classify.classes);
+        }
+    }
+
+    /**
+     * The gate model runs at the lower gate threshold so its boxes can keep
+     * the gate open, they are also the results while the gate is closed.
+     */
+    if (gatemodel) {
+        gate.vaal = vaal_context_create(engine);
+        if (!gate.vaal) {
+            fprintf(stderr, "failed to create vaal context\n");
+            return EXIT_FAILURE;
+        }
+
+        err = vaal_load_model_file(gate.vaal, gatemodel);
+        if (err) {
+            fprintf(stderr,
+                    "failed to load %s: %s\n",
+                    gatemodel,
+                    vaal_strerror(VAALError(err)));
+            return EXIT_FAILURE;
+        }
+
+        float gate_threshold = std::min(gate.low, threshold);
+        vaal_parameter_setf(gate.vaal, "score_threshold", &gate_threshold, 1);
+        vaal_parameter_setf(gate.vaal, "iou_threshold", &iou, 1);
+        vaal_parameter_sets(gate.vaal, "nms_type", "standard", 0);
+        vaal_parameter_seti(gate.vaal, "max_detection", &max_boxes, 1);
+
+        gate.min_score = threshold;
+        gate.boxes.resize(max_boxes);
+        gate_init(gate, vaal, gatemodel, gatelist);
+    }
+
+    if (ensemble_models.size() || classifier || gatemodel) {
+        startup_phase(timer, "models");
+    }
 
     vaal_parameter_setf(vaal, "score_threshold", &threshold, 1);
     vaal_parameter_setf(vaal, "iou_threshold", &iou, 1);
     vaal_parameter_sets(vaal, "nms_type", "standard", 0);
     vaal_parameter_seti(vaal, "max_detection", &max_boxes, 1);
 
-    std::vector<VAALBox> boxes(max_boxes);
+    /**
+     * The native decoder is configured from the model outputs, it is also
+     * required by the benchmark even when vaal_boxes remains selected.
+     */
+    if (decoder.enabled || benchmark_nms) {
+        decoder.score_threshold = threshold;
+        decoder.iou_threshold   = iou;
+        if (native::decoder_init(decoder, vaal)) {
+            fprintf(stderr, "unsupported model outputs for native decoding\n");
+            return EXIT_FAILURE;
+        }
+        if (verbose) {
+            printf("native decoding %zu anchors %zu classes with %s nms\n",
+                   decoder.anchors,
+                   decoder.classes,
+                   nms);
+        }
+    }
 
     /**
-     * The ZeroMQ Context is required for all ZeroMQ API functions.  We create
-     * the context then we create our publisher socket which will be used for
-     * publishing detection results from VAAL.
+     * The first inferences include the graph compilation, or loading it from
+     * the cache, so they are run before anything is published.
      */
-    zmq::context_t ctx;
-    zmq::socket_t  pub(ctx, zmq::socket_type::pub);
-    pub.set(zmq::sockopt::conflate, 1);
-    pub.set(zmq::sockopt::rcvhwm, 1);
-    pub.bind(puburl);
+    if (warmup > 0) {
+        std::vector<VAALContext*> contexts = {vaal};
+        for (auto& member : fusion.members) {
+            if (member.vaal) { contexts.push_back(member.vaal); }
+        }
+        if (classify.vaal) { contexts.push_back(classify.vaal); }
+        if (gate.vaal) { contexts.push_back(gate.vaal); }
 
-    if (verbose) {
-        printf("publishing results to [%s]: %s\n", topic.c_str(), puburl);
+        for (auto context : contexts) {
+            for (int i = 0; i < warmup; i++) {
+                err = vaal_run_model(context);
+                if (err) {
+                    fprintf(stderr,
+                            "failed to run model: %s\n",
+                            vaal_strerror(VAALError(err)));
+                    return EXIT_FAILURE;
+                }
+            }
+        }
+        startup_phase(timer, "warmup");
     }
 
     /**
-     * The application uses the VideoStream Library for sharing camera frames
-     * between the various applications for this demonstration.  We initialize
-     * the client to connect to vslpath which should be the end-point into which
-     * we inject capture frames using GStreamer and vslsink or a native vslhost
-     * application.
+     * The image mode creates a VAALContext and native decoder for each
+     * additional job, then writes the results to the output file or stdout
+     * and exits.
      */
-    vsl = vsl_client_init(vslpath, NULL, true);
-    if (!vsl) {
-        fprintf(stderr,
-                "failed to connect videostream socket %s: %s\n",
-                vslpath,
-                strerror(errno));
-        return EXIT_FAILURE;
-    }
+    if (imagedir) {
+        image_batch batch;
+        batch.jobs = jobs;
+        if (image_list(batch.paths, imagedir)) { return EXIT_FAILURE; }
+        std::sort(batch.paths.begin(), batch.paths.end());
+
+        if (verbose) {
+            fprintf(stderr,
+                    "processing %zu images from %s with %d jobs\n",
+                    batch.paths.size(),
+                    imagedir,
+                    jobs);
+        }
 
-    if (verbose) { printf("capturing frames from %s\n", vslpath); }
+        std::vector<native::decoder> decoders(jobs, decoder);
+        std::vector<pipeline>        pipes(jobs);
 
-    // 100ms timeout on frame capture.
-    vsl_client_set_timeout(vsl, 0.1f);
+        for (int i = 0; i < jobs; i++) {
+            VAALContext* worker = vaal;
+            if (i > 0) {
+                worker = vaal_context_create(engine);
+                if (!worker) {
+                    fprintf(stderr, "failed to create vaal context\n");
+                    return EXIT_FAILURE;
+                }
+
+                err = vaal_load_model_file(worker, model);
+                if (err) {
+                    fprintf(stderr,
+                            "failed to load %s: %s\n",
+                            model,
+                            vaal_strerror(VAALError(err)));
+                    return EXIT_FAILURE;
+                }
+
+                vaal_parameter_setf(worker, "score_threshold", &threshold, 1);
+                vaal_parameter_setf(worker, "iou_threshold", &iou, 1);
+                vaal_parameter_sets(worker, "nms_type", "standard", 0);
+                vaal_parameter_seti(worker, "max_detection", &max_boxes, 1);
+
+                if ((decoder.enabled || benchmark_nms) &&
+                    native::decoder_init(decoders[i], worker)) {
+                    fprintf(stderr,
+                            "unsupported model outputs for native decoding\n");
+                    return EXIT_FAILURE;
+                }
+            }
+
+            pipes[i].vaal   = worker;
+            pipes[i].model  = strrchr(model, '/') ? strrchr(model, '/') + 1
+                                                  : model;
+            pipes[i].native = decoder.enabled || benchmark_nms ? &decoders[i]
+                                                               : NULL;
+            pipes[i].filter = filterpath ? &filter : NULL;
+            pipes[i].boxes.resize(max_boxes);
+            pipes[i].label_ids = label_ids;
+            label_intern(pipes[i].labels, worker);
+        }
+
+        batch.output = stdout;
+        if (outpath && strcmp(outpath, "-")) {
+            batch.output = fopen(outpath, "w");
+            if (!batch.output) {
+                fprintf(stderr,
+                        "failed to open output %s: %s\n",
+                        outpath,
+                        strerror(errno));
+                return EXIT_FAILURE;
+            }
+        }
+
+        if (verbose) { startup_report(timer, "model"); }
+        signal(SIGINT, quit);
+        err = image_run(batch, pipes);
+
+        if (batch.output != stdout) { fclose(batch.output); }
+        for (auto& worker : pipes) { vaal_context_release(worker.vaal); }
+
+        return err ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    if (connected.get()) { return EXIT_FAILURE; }
+    startup_phase(timer, "join");
 
     /**
-     * Install a SIGINT handler so we can cleanup on a control-c keyboard input.
+     * The pipeline collects the model and the stages enabled on the command
+     * line which are applied to every frame.
      */
-    signal(SIGINT, quit);
+    pipeline pipe;
+    pipe.vaal       = vaal;
+    pipe.model      = strrchr(model, '/') ? strrchr(model, '/') + 1 : model;
+    pipe.gate       = gate.vaal ? &gate : NULL;
+    pipe.native     = decoder.enabled || benchmark_nms ? &decoder : NULL;
+    pipe.fusion     = fusion.members.empty() ? NULL : &fusion;
+    pipe.classify   = classify.vaal ? &classify : NULL;
+    pipe.filter     = filterpath ? &filter : NULL;
+    pipe.zones      = zonepath ? &zones : NULL;
+    pipe.tracks     = tracking ? &tracks : NULL;
+    pipe.lines      = linepath ? &lines : NULL;
+    pipe.threshold  = threshold;
+    pipe.iou        = iou;
+    pipe.skip       = frame_skip;
+    pipe.swap       = ctlurl || watch;
+    pipe.started    = timer.start;
+    pipe.exit_first = benchmark_startup;
+    pipe.label_ids  = label_ids;
+    pipe.policy     = policy.changes ? &policy : NULL;
+    pipe.history    = history.window ? &history : NULL;
+    pipe.held       = held.capacity ? &held : NULL;
+    pipe.snapshot   = snapshot || snapshots.zones ? &snapshots : NULL;
+    pipe.stream     = &stream;
+    pipe.boxes.resize(max_boxes);
+    label_intern(pipe.labels, vaal);
+    label_intern(pipe.class_labels, classify.vaal);
+
+    zones.labels    = &pipe.labels;
+    zones.label_ids = label_ids;
+    lines.labels    = &pipe.labels;
+    lines.label_ids = label_ids;
+
+    if (snapshot) {
+        label_list(vaal, snapshot, "--snapshot", snapshots.classes);
+    }
+
+    if (archive.dir) {
+        if (cache_mkdir(archive.dir)) {
+            fprintf(stderr,
+                    "failed to create archive %s: %s\n",
+                    archive.dir,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        archive.labels       = pipe.labels;
+        archive.class_labels = pipe.class_labels;
+        pipe.archive         = &archive;
+    }
+
+    if (ring.name) {
+        if (ring_create(ring, vaal)) { return EXIT_FAILURE; }
+        pipe.ring = &ring;
+        if (verbose) {
+            printf("writing results to /dev/shm/%s with %u records\n",
+                   ring.name,
+                   ring.capacity);
+        }
+    }
+
+    if (outpath) {
+        output = strcmp(outpath, "-") ? fopen(outpath, "w") : stdout;
+        if (!output) {
+            fprintf(stderr,
+                    "failed to open output %s: %s\n",
+                    outpath,
+                    strerror(errno));
+            return EXIT_FAILURE;
+        }
+        pipe.output = output;
+    }
 
     /**
      * There's many different ways for an application to implement its event
-     * loop.  Here have a function which reads frames from vsl to send to the
-     * model to perform inference then finally publishes results as JSON over
-     * the ZeroMQ socket.  The application loop simply runs this function
-     * forever.
+     * loop.  Here the reactor waits on the frame source, the signals and the
+     * timers together and calls the handler of whichever is ready.  Each frame
+     * is sent to the model to perform inference then finally the results are
+     * published as JSON over the ZeroMQ socket.
+     *
+     * SIGINT and SIGTERM are received through the reactor so we can cleanup on
+     * a control-c keyboard input, they must be blocked before the capture
+     * thread is started.
      */
-    while (running) {
-        err = handle_vsl(pub, topic, capture, vaal, boxes);
+    reactor loop;
+
+    if (reactor_init(loop) || reactor_signals(loop, quit)) {
+        return EXIT_FAILURE;
+    }
+
+    if (pipe.lines) {
+        err = reactor_timer(loop, lines.interval, [&]() {
+            line_totals(lines, pub);
+            return 0;
+        });
+        if (err) { return EXIT_FAILURE; }
+    }
+
+    if (pipe.archive) {
+        err = reactor_timer(loop, archive.flush, [&]() {
+            archive_flush(archive);
+            return 0;
+        });
+        if (err) { return EXIT_FAILURE; }
+    }
+
+    /**
+     * The optional control channel changes the settings while running, every
+     * topic can be changed as well.
+     */
+    zmq::socket_t ctlsock;
+    control       ctl;
+    model_swap    swap;
+
+    swap.engine  = engine;
+    swap.path    = model;
+    swap.swapped = [&]() { label_publish(pub, labeltopic, pipe); };
+    swap.event  = reactor_event(loop, [&]() {
+        return swap_finish(swap, pipe);
+    });
+    if (swap.event < 0) { return EXIT_FAILURE; }
+
+    if (watch) {
+        if (swap_watch(swap)) { return EXIT_FAILURE; }
+        err = reactor_add(loop, swap.inotify, EPOLLIN, [&](uint32_t) {
+            return swap_watch_handle(swap, pipe);
+        });
+        if (err) { return EXIT_FAILURE; }
+    }
+
+    zmq::socket_t lastsock;
+    if (lasturl) {
+        lastsock = zmq::socket_t(ctx, zmq::socket_type::rep);
+        lastsock.bind(lasturl);
+
+        err = reactor_add_zmq(loop, lastsock, [&]() {
+            return last_value_handle(lastsock);
+        });
+        if (err) { return EXIT_FAILURE; }
+
+        if (verbose) { printf("last values on %s\n", lasturl); }
+    }
+
+    if (ctlurl) {
+        ctl.pipe    = &pipe;
+        ctl.swap    = &swap;
+        ctl.dropped = &grabber.dropped;
+        ctl.started = vaal_clock_now();
+        ctl.labels  = [&]() { label_publish(pub, labeltopic, pipe); };
+        ctl.topics  = {
+            {"topic", &topic},
+            {"capture_topic", &capture},
+            {"label_topic", &labeltopic},
+            {"stream_topic", &stream.topic},
+            {"zone_topic", &zones.topic},
+            {"line_topic", &lines.topic},
+            {"snapshot_topic", &snapshots.topic},
+            {"connection_topic", &grabber.topic},
+        };
+
+        ctlsock = zmq::socket_t(ctx, zmq::socket_type::rep);
+        ctlsock.bind(ctlurl);
+
+        err = reactor_add_zmq(loop, ctlsock, [&]() {
+            return control_handle(ctl, ctlsock);
+        });
+        if (err) { return EXIT_FAILURE; }
+
+        if (verbose) { printf("control channel on %s\n", ctlurl); }
+    }
+
+    if (pipe.snapshot) {
+        snapshots.event = reactor_event(loop, [&]() {
+            return snapshot_publish(snapshots, pub);
+        });
+        if (snapshots.event < 0) { return EXIT_FAILURE; }
+        snapshot_start(snapshots);
+    }
+
+    if (raw.path) {
+        stream.source = raw.path;
+        stream.fps    = raw.fps;
+
+        /**
+         * The raw input is always ready, the handler wakes the reactor again
+         * after each frame so signals are still handled between frames.
+         */
+        int event = -1;
+        event     = reactor_event(loop, [&]() {
+            int err = handle_raw(pub, topic, capture, pipe, raw);
+            if (!err && running) { reactor_notify(event); }
+            return err;
+        });
+        if (event < 0) { return EXIT_FAILURE; }
+        reactor_notify(event);
+    } else if (v4l2dev) {
+        stream.source = v4l2dev;
+        stream.fps    = camera.fps;
+        err = reactor_add(loop, camera.fd, EPOLLIN, [&](uint32_t) {
+            return handle_v4l2(pub, topic, capture, pipe, camera);
+        });
         if (err) { return EXIT_FAILURE; }
+    } else {
+        stream.source = vslpath;
+        grabber.path  = vslpath;
+        grabber.event = reactor_event(loop, [&]() {
+            return handle_vsl(pub, topic, capture, pipe, grabber);
+        });
+        if (grabber.event < 0) { return EXIT_FAILURE; }
+        grabber.thread = std::thread(vsl_capture_thread, std::ref(grabber));
+    }
+
+    if (verbose || pipe.exit_first) {
+        startup_report(timer, "model");
+        startup_report(iotimer, "io");
+    }
+    label_publish(pub, labeltopic, pipe);
+    err = reactor_run(loop);
+
+    running = 0;
+    snapshot_stop(snapshots);
+    frame_clear(held);
+    vsl_capture_stop(grabber);
+    if (swap.thread.joinable()) { swap.thread.join(); }
+    if (swap.vaal) { vaal_context_release(swap.vaal); }
+    if (swap.inotify >= 0) { close(swap.inotify); }
+    reactor_close(loop);
+    archive_close(archive);
+    if (err) { return EXIT_FAILURE; }
+
+    if (verbose && grabber.dropped) {
+        printf("dropped %lld frames waiting on the model\n",
+               (long long) grabber.dropped);
+    }
+
+    if (verbose && snapshots.dropped) {
+        printf("dropped %lld snapshots waiting on the encoders\n",
+               (long long) snapshots.dropped);
     }
 
     /**
@@ -461,7 +8178,16 @@ main(int argc, char** argv)
      * valgrind noise, use the CPU for inference if you wish to test your
      * application for resource leaks.
      */
-    vaal_context_release(vaal);
+    for (auto& member : fusion.members) {
+        if (member.vaal) { vaal_context_release(member.vaal); }
+    }
+    if (classify.vaal) { vaal_context_release(classify.vaal); }
+    if (gate.vaal) { vaal_context_release(gate.vaal); }
+    v4l2_close(camera);
+    raw_close(raw);
+    ring_close(ring);
+    if (output && output != stdout) { fclose(output); }
+    vaal_context_release(pipe.vaal);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,343 @@
+/**
+ * Copyright 2022 by Au-Zone Technologies.  All Rights Reserved.
+ *
+ * Software that is described herein is for illustrative purposes only which
+ * provides customers with programming information regarding the DeepView VAAL
+ * library. This software is supplied "AS IS" without any warranties of any
+ * kind, and Au-Zone Technologies and its licensor disclaim any and all
+ * warranties, express or implied, including all implied warranties of
+ * merchantability, fitness for a particular purpose and non-infringement of
+ * intellectual property rights.  Au-Zone Technologies assumes no responsibility
+ * or liability for the use of the software, conveys no license or rights under
+ * any patent, copyright, mask work right, or any other intellectual property
+ * rights in or to any products. Au-Zone Technologies reserves the right to make
+ * changes in the software without notification. Au-Zone Technologies also makes
+ * no representation or warranty that such application will be suitable for the
+ * specified use without further testing or modification.
+ */
+
+/**
+ * The detect result ring is a shared memory alternative to the ZeroMQ results
+ * for consumers running on the same device.  When started with --ring NAME the
+ * detect application creates /dev/shm/NAME holding a header, the model's label
+ * table and a ring of fixed size result records.  There is a single writer and
+ * any number of readers which never block the writer: each record is protected
+ * by a sequence lock which is odd while the record is being written, a reader
+ * copies the record and retries if the sequence changed meanwhile.  Readers
+ * which fall behind by more than the ring capacity lose the oldest records.
+ *
+ * Waiting readers are counted in the header so the writer only wakes the futex
+ * when a reader sleeps on it.  Registering needs write access to the ring, a
+ * reader which only has read access polls every millisecond instead.
+ *
+ * The header only depends on the C library and the GCC atomic builtins so it
+ * can be used from C and C++.  A minimal reader looks like:
+ *
+ *     struct detect_ring        ring;
+ *     struct detect_ring_record record;
+ *     uint64_t                  next;
+ *
+ *     detect_ring_open(&ring, "detect");
+ *     next = detect_ring_head(&ring);
+ *     for (;;) {
+ *         detect_ring_wait(&ring, next, 1000);
+ *         int err = detect_ring_read(&ring, next, &record);
+ *         if (err == DETECT_RING_AGAIN) { continue; }
+ *         if (err == DETECT_RING_LOST) { next = detect_ring_head(&ring); }
+ *         else { handle(&record); next++; }
+ *     }
+ */
+
+#ifndef DETECT_RING_H
+#define DETECT_RING_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DETECT_RING_MAGIC 0x474e495254454400ull
+#define DETECT_RING_VERSION 2
+#define DETECT_RING_MAX_OBJECTS 64
+#define DETECT_RING_LABEL_SIZE 64
+
+#define DETECT_RING_OK 0
+#define DETECT_RING_AGAIN 1
+#define DETECT_RING_LOST 2
+#define DETECT_RING_POLL_NS 1000000
+
+struct detect_ring_object {
+    float    xmin;
+    float    ymin;
+    float    xmax;
+    float    ymax;
+    float    score;
+    int32_t  label;
+    uint32_t track;
+    int32_t  class_label;
+    float    class_score;
+};
+
+/**
+ * A result record, label is an index into the ring's label table and
+ * class_label an index into the classifier labels or -1.  The count is limited
+ * to DETECT_RING_MAX_OBJECTS while total holds the number of objects detected.
+ */
+struct detect_ring_record {
+    uint32_t                  seq;
+    uint32_t                  count;
+    uint64_t                  index;
+    int64_t                   timestamp;
+    int64_t                   model_ns;
+    uint32_t                  total;
+    int32_t                   fps;
+    struct detect_ring_object objects[DETECT_RING_MAX_OBJECTS];
+};
+
+/**
+ * The shared memory starts with the header, followed by label_count labels of
+ * DETECT_RING_LABEL_SIZE bytes at labels_offset and capacity records at
+ * records_offset.  The head is the number of records written so far, wake is
+ * its low 32 bits used as the futex readers wait on and waiters the number of
+ * readers waiting on it.
+ */
+struct detect_ring_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t record_size;
+    uint32_t max_objects;
+    uint32_t label_count;
+    uint32_t label_size;
+    uint64_t labels_offset;
+    uint64_t records_offset;
+    uint64_t size;
+
+    uint64_t head __attribute__((aligned(64)));
+    uint32_t wake;
+    uint32_t waiters;
+};
+
+/**
+ * The ring is mapped read-only, only the waiter count is written through a
+ * separate mapping of the header which is NULL for read-only readers.
+ */
+struct detect_ring {
+    int                        fd;
+    size_t                     size;
+    struct detect_ring_header* header;
+    struct detect_ring_record* records;
+    const char*                labels;
+    struct detect_ring_header* control;
+};
+
+/**
+ * Maps the ring /dev/shm/name for reading.  Returns 0 on success or -1 with
+ * errno set, EPROTO if the ring has an incompatible version.
+ */
+static inline int
+detect_ring_open(struct detect_ring* ring, const char* name)
+{
+    char        path[256] = "/";
+    struct stat st;
+
+    strncat(path, name, sizeof(path) - 2);
+    memset(ring, 0, sizeof(*ring));
+
+    ring->fd = shm_open(path, O_RDWR | O_CLOEXEC, 0);
+    if (ring->fd < 0 && errno == EACCES) {
+        ring->fd = shm_open(path, O_RDONLY | O_CLOEXEC, 0);
+    }
+    if (ring->fd < 0) { return -1; }
+
+    if (fstat(ring->fd, &st) ||
+        (size_t) st.st_size < sizeof(struct detect_ring_header)) {
+        close(ring->fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, ring->fd, 0);
+    if (map == MAP_FAILED) {
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->size   = st.st_size;
+    ring->header = (struct detect_ring_header*) map;
+
+    if (ring->header->magic != DETECT_RING_MAGIC ||
+        ring->header->version != DETECT_RING_VERSION ||
+        ring->header->record_size != sizeof(struct detect_ring_record) ||
+        ring->header->size > ring->size) {
+        munmap(map, ring->size);
+        close(ring->fd);
+        errno = EPROTO;
+        return -1;
+    }
+
+    ring->labels  = (const char*) map + ring->header->labels_offset;
+    ring->records = (struct detect_ring_record*) ((char*) map +
+                                                  ring->header->records_offset);
+
+    void* control = mmap(NULL,
+                         sizeof(struct detect_ring_header),
+                         PROT_READ | PROT_WRITE,
+                         MAP_SHARED,
+                         ring->fd,
+                         0);
+    if (control != MAP_FAILED) {
+        ring->control = (struct detect_ring_header*) control;
+    }
+    return 0;
+}
+
+static inline void
+detect_ring_close(struct detect_ring* ring)
+{
+    if (ring->control) {
+        munmap(ring->control, sizeof(struct detect_ring_header));
+    }
+    if (ring->header) { munmap(ring->header, ring->size); }
+    if (ring->fd >= 0) { close(ring->fd); }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/**
+ * The label of index, or NULL if out of range.
+ */
+static inline const char*
+detect_ring_label(const struct detect_ring* ring, int32_t index)
+{
+    if (index < 0 || (uint32_t) index >= ring->header->label_count) {
+        return NULL;
+    }
+    return ring->labels + (size_t) index * ring->header->label_size;
+}
+
+/**
+ * The number of records written so far, the index of the next record.
+ */
+static inline uint64_t
+detect_ring_head(const struct detect_ring* ring)
+{
+    return __atomic_load_n(&ring->header->head, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Copies record index into out.  Returns DETECT_RING_AGAIN if the record is
+ * not written yet and DETECT_RING_LOST if it was already overwritten.
+ */
+static inline int
+detect_ring_read(const struct detect_ring*  ring,
+                 uint64_t                   index,
+                 struct detect_ring_record* out)
+{
+    const struct detect_ring_record* record =
+        &ring->records[index % ring->header->capacity];
+
+    for (;;) {
+        if (index >= detect_ring_head(ring)) { return DETECT_RING_AGAIN; }
+
+        uint32_t seq = __atomic_load_n(&record->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) { continue; }
+
+        memcpy(out, record, sizeof(*out));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&record->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+        if (out->index != index) {
+            return out->index > index ? DETECT_RING_LOST : DETECT_RING_AGAIN;
+        }
+        if (out->count > DETECT_RING_MAX_OBJECTS) {
+            out->count = DETECT_RING_MAX_OBJECTS;
+        }
+        return DETECT_RING_OK;
+    }
+}
+
+/**
+ * Waits until record index is written or timeout milliseconds pass, a negative
+ * timeout waits forever.  The timeout is an absolute deadline on the monotonic
+ * clock so wakeups by signals or other records do not extend it.  Returns 0
+ * once available or -1 on timeout.
+ */
+static inline int
+detect_ring_wait(const struct detect_ring* ring, uint64_t index, int timeout)
+{
+    struct timespec deadline;
+    int             result = -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    /**
+     * The waiter is counted before the head is checked, the writer publishes
+     * the head before reading the count, so either the new head is seen here
+     * or the writer sees the waiter and wakes the futex.
+     */
+    if (ring->control) {
+        __atomic_add_fetch(&ring->control->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+
+    for (;;) {
+        uint32_t wake = __atomic_load_n(&ring->header->wake, __ATOMIC_SEQ_CST);
+        if (index < detect_ring_head(ring)) {
+            result = 0;
+            break;
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (timeout >= 0 && (now.tv_sec > deadline.tv_sec ||
+                             (now.tv_sec == deadline.tv_sec &&
+                              now.tv_nsec >= deadline.tv_nsec))) {
+            break;
+        }
+
+        if (!ring->control) {
+            struct timespec poll = {0, DETECT_RING_POLL_NS};
+            nanosleep(&poll, NULL);
+            continue;
+        }
+
+        syscall(SYS_futex,
+                &ring->header->wake,
+                FUTEX_WAIT_BITSET,
+                wake,
+                timeout < 0 ? NULL : &deadline,
+                NULL,
+                FUTEX_BITSET_MATCH_ANY);
+    }
+
+    if (ring->control) {
+        __atomic_sub_fetch(&ring->control->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    return result;
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* DETECT_RING_H */